@@ -93,13 +93,14 @@ static char *asc_read_subtitles (char *ascfile, char *lang)
 char *get_virtual_srt(char *title, double watchtime, double length, char *lang)
 {
 	char *ret = NULL;
+	char t1[TIMESTR_SIZE], t2[TIMESTR_SIZE], t3[TIMESTR_SIZE];
 	int i, linenum;
 
 	asprintf (&ret,
 		  "1\n00:00:00,00 --> 00:00:05,00\n"
 		  "%s\n%.2lf × %s\n\n",
 		  title, length >= 1.0 ? 1.0 * watchtime / length : 0,
-		  secs_to_timestr (length));
+		  secs_to_timestr (length, t1));
 
 	linenum = 2;
 	for (i = 15; i < (int)length; i += 15)
@@ -109,9 +110,9 @@ char *get_virtual_srt(char *title, double watchtime, double length, char *lang)
 		asprintf (&line,
 			"%d\n00:%s.00 --> 00:%s,00\n%s\n\n",
 			linenum++,
-			secs_to_timestr (i),
-			secs_to_timestr (i+1),
-			secs_to_timestr (i));
+			secs_to_timestr (i, t1),
+			secs_to_timestr (i+1, t2),
+			secs_to_timestr (i, t3));
 
 		asprintf (&tmp, "%s%s", ret, line);
 		free (ret);
@@ -2,6 +2,7 @@
 #include <fuse/fuse_lowlevel.h>
 
 #include "entry.h"
+#include "inval.h"
 
 /*
  * Get file attributes
@@ -25,7 +26,7 @@ void atrfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	if (err)
 		fuse_reply_err (req, err);
 	else
-		fuse_reply_attr (req, &st, 0.0);
+		fuse_reply_attr (req, &st, CACHE_TIMEOUT);
 }
 
 /*
@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "entry.h"
+#include "entrydb.h"
 
+/* The names are copies: the entries may move while the directory is open. */
 struct directory_data
 {
 	GList *files;
@@ -57,6 +59,8 @@ void atrfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	if (data)
 	{
 		data->files = g_hash_table_get_keys(DIR_ENTRY(ino_to_entry(ino))->contents);
+		for (GList *l = data->files; l; l = l->next)
+			l->data = strdup(l->data);
 		data->cur = data->files;
 		set_data(fi, data);
 		fuse_reply_open(req, fi);
@@ -92,19 +96,26 @@ void atrfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
 	struct atrfs_entry *parent = ino_to_entry(ino);
 	struct directory_data *data = get_data(fi);
-	int err = 0;
 
 	char *buf = malloc(size);
 	int pos = 0;
 
 	while (data->cur)
 	{
-		struct stat st;
 		struct atrfs_entry *ent = lookup_entry_by_name(parent, data->cur->data);
 
-		err = ent->ops->stat (ent, &st);
-		if (err)
-			goto out_err;
+		/* Moved or removed since opendir */
+		if (!ent)
+		{
+			data->cur = data->cur->next;
+			continue;
+		}
+
+		/* Only the inode and the type are used: the real file need not be stat()ed. */
+		struct stat st = {
+			.st_ino = (ino_t)(unsigned long)ent,
+			.st_mode = ent->e_type == ATRFS_DIRECTORY_ENTRY ? S_IFDIR : S_IFREG,
+		};
 
 		int len = fuse_dirent_size(strlen(data->cur->data));
 		if (pos + len > size)
@@ -120,14 +131,9 @@ void atrfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 		fuse_reply_buf(req, buf, pos);
 		free (buf);
 	} else {
+		free(buf);
 		fuse_reply_buf(req, NULL, 0);
 	}
-
-	return;
-out_err:
-	if (buf)
-		free(buf);
-	fuse_reply_err (req, err);
 }
 
 /*
@@ -151,6 +157,8 @@ void atrfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	struct atrfs_entry *ent = ino_to_entry(ino);
 	tmplog("releasedir('%s')\n", ent->name);
 	struct directory_data *data = get_data(fi);
+	for (GList *l = data->files; l; l = l->next)
+		free(l->data);
 	g_list_free(data->files);
 	free(data);
 	fuse_reply_err(req, 0);
@@ -177,6 +185,7 @@ void atrfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_fi
 {
 	struct atrfs_entry *ent = ino_to_entry(ino);
 	tmplog("fsyncdir('%s')\n", ent->name);
+	entrydb_flush();
 	fuse_reply_err(req, 0);
 }
 
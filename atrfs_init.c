@@ -8,6 +8,9 @@
 #include <string.h>
 #include <unistd.h>
 #include "entry.h"
+#include "entrydb.h"
+#include "idcache.h"
+#include "snapshot.h"
 #include "util.h"
 
 /*
@@ -22,6 +25,12 @@
  */
 void atrfs_init(void *userdata, struct fuse_conn_info *conn)
 {
+#ifdef FUSE_CAP_SPLICE_WRITE
+	/* atrfs_read() replies with the files; let libfuse splice them. */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+	tmplog("init(): capable %#x, want %#x, max_readahead %u\n",
+	       conn->capable, conn->want, conn->max_readahead);
 }
 
 /*
@@ -36,5 +45,7 @@ void atrfs_init(void *userdata, struct fuse_conn_info *conn)
 void atrfs_destroy(void *userdata)
 {
 	tmplog("destroy()\n");
+	snapshot_save ();
 	close_entrydb ();
+	idcache_close ();
 }
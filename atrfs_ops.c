@@ -7,7 +7,10 @@
 #include <string.h>
 #include <unistd.h>
 #include "atrfs_ops.h"
+#include "dispatch.h"
 #include "entry.h"
+#include "entrydb.h"
+#include "inval.h"
 #include "subtitles.h"
 #include "util.h"
 
@@ -48,8 +51,8 @@ void atrfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	ep.ino = (fuse_ino_t)ent;
 	ep.generation = 1;
 	ep.attr = st;
-	ep.attr_timeout = 1.0;
-	ep.entry_timeout = 1.0;
+	ep.attr_timeout = CACHE_TIMEOUT;
+	ep.entry_timeout = CACHE_TIMEOUT;
 
 	fuse_reply_entry(req, &ep);
 }
@@ -194,10 +197,16 @@ static int open_file(char *cmd, struct atrfs_entry *ent, int flags)
 	int fd = FILE_ENTRY(ent)->fd;
 	if (fd < 0)
 	{
-		fd = open(filename, flags);
+		char path[strlen(filename) + 1];
+		strcpy(path, filename);
+
+		/* ENTRY_BUSY, set by the caller, keeps other opens away meanwhile. */
+		dispatch_unlock();
+		fd = open(path, flags);
 		if (fd < 0)
 			fd = -errno;
-		else
+		dispatch_relock();
+		if (fd >= 0)
 			FILE_ENTRY(ent)->fd = fd;
 	}
 	return fd;
@@ -234,7 +243,8 @@ void atrfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 	struct atrfs_entry *ent = ino_to_entry(ino);
-	char *cmd = pid_to_cmdline(ctx->pid);
+	char cmdbuf[128];
+	char *cmd = pid_to_cmdline(ctx->pid, cmdbuf, sizeof(cmdbuf));
 
 	tmplog("'%s': open('%s')\n", cmd, ent->name);
 
@@ -261,12 +271,15 @@ void atrfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 		break;
 	case ATRFS_FILE_ENTRY:
 	{
-		int fd = open_file (cmd, ent, fi->flags);
+		int fd;
+
+		ent->flags |= ENTRY_BUSY;
+		fd = open_file (cmd, ent, fi->flags);
 		if (fd < 0)
 		{
+			ent->flags &= ~ENTRY_BUSY;
 			fuse_reply_err (req, -fd);
 		} else {
-			ent->flags |= ENTRY_BUSY;
 			fuse_reply_open (req, fi);
 		}
 		break;
@@ -294,6 +307,7 @@ void atrfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
  *
  * Valid replies:
  *   fuse_reply_buf
+ *   fuse_reply_data
  *   fuse_reply_err
  *
  * @param req request handle
@@ -309,6 +323,26 @@ void atrfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct f
 	struct atrfs_entry *ent = ino_to_entry(ino);
 	tmplog("read('%s', size=%lu, off=%lu)\n", ent->name, size, off);
 
+#ifdef FUSE_CAP_SPLICE_WRITE
+	/*
+	 * Give libfuse the real file instead of the data: when atrfs_init()
+	 * got splice from the kernel, the pages go from the page cache to
+	 * /dev/fuse without being copied through this process.
+	 */
+	if (ent->e_type == ATRFS_FILE_ENTRY)
+	{
+		struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+		bv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bv.buf[0].fd = FILE_ENTRY(ent)->fd;
+		bv.buf[0].pos = off;
+
+		/* The fd stays open: release comes after the last read. */
+		dispatch_unlock();
+		fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+#endif
+
 	if (! ent->ops->read)
 	{
 		fuse_reply_err (req, ENOSYS);
@@ -555,7 +589,10 @@ void atrfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_
 {
 	struct atrfs_entry *ent = ino_to_entry(ino);
 	tmplog("fsync('%s', %d)\n", ent->name, datasync);
-	fuse_reply_err(req, ENOSYS);
+
+	/* The attributes of the file may still be waiting for a commit. */
+	entrydb_flush();
+	fuse_reply_err(req, 0);
 }
 
 /*
@@ -6,26 +6,58 @@
 #include <stdio.h>
 #include <string.h>
 #include "entry.h"
+#include "media.h"
+#include "probe.h"
 #include "util.h"
 
-static char *get_realname(struct atrfs_entry *ent)
+/* The values are formatted in BUF, of XATTR_SIZE chars, when needed. */
+#define XATTR_SIZE 32
+
+static char *get_realname(struct atrfs_entry *ent, char *buf)
 {
 	return REAL_NAME(ent);
 };
 
-static char *get_lengthstr(struct atrfs_entry *ent)
+/* Media properties are read in the background; until then they are unknown. */
+static char *get_lengthstr(struct atrfs_entry *ent, char *buf)
+{
+	double length = get_length (ent);
+	return length > 0.0 ? secs_to_timestr (length, buf) : "unknown";
+}
+
+static char *get_resolutionstr(struct atrfs_entry *ent, char *buf)
+{
+	int width = get_media_ivalue (ent, "width");
+	int height = get_media_ivalue (ent, "height");
+
+	if (!width || !height)
+		return "unknown";
+	sprintf(buf, "%dx%d", width, height);
+	return buf;
+}
+
+static char *get_codecstr(struct atrfs_entry *ent, char *buf)
 {
-	return secs_to_timestr (get_length (ent));
+	return (char *)codec_name (get_media_ivalue (ent, "codec"));
+}
+
+static char *get_keyframestr(struct atrfs_entry *ent, char *buf)
+{
+	int keyframes = get_media_ivalue (ent, "keyframes");
+
+	if (!keyframes)
+		return "unknown";
+	sprintf(buf, "%d", keyframes);
+	return buf;
 }
 
-static char *get_watchtimestr(struct atrfs_entry *ent)
+static char *get_watchtimestr(struct atrfs_entry *ent, char *buf)
 {
-	return secs_to_timestr (get_watchtime (ent));
+	return secs_to_timestr (get_watchtime (ent), buf);
 }
 
-static char *get_countstr(struct atrfs_entry *ent)
+static char *get_countstr(struct atrfs_entry *ent, char *buf)
 {
-	static char buf[10]; //XXX
 	sprintf(buf, "%d", get_watchcount (ent));
 	return buf;
 }
@@ -33,10 +65,13 @@ static char *get_countstr(struct atrfs_entry *ent)
 static struct virtual_xattr
 {
 	char *name;
-	char *(*fn)(struct atrfs_entry *ent);
+	char *(*fn)(struct atrfs_entry *ent, char *buf);
 } atrfs_attributes[] = {
 	{"user.realname", get_realname},
 	{"user.length", get_lengthstr},
+	{"user.resolution", get_resolutionstr},
+	{"user.codec", get_codecstr},
+	{"user.keyframes", get_keyframestr},
 	{"user.watchtime", get_watchtimestr},
 	{"user.count", get_countstr},
 	{NULL, NULL}
@@ -92,7 +127,8 @@ void atrfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t siz
 		if (strcmp(name, atrfs_attributes[i].name))
 			continue;
 
-		char *ret = atrfs_attributes[i].fn(ent);
+		char buf[XATTR_SIZE];
+		char *ret = atrfs_attributes[i].fn(ent, buf);
 
 		if (size == 0)
 		{
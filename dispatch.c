@@ -0,0 +1,365 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+#include "workqueue.h"
+
+/* In entry.c */
+extern pthread_rwlock_t tree_lock;
+
+/*
+ * With fuse-threads=N the main loop still reads the requests from
+ * the FUSE channel, but gives them to a pool of N threads. Almost
+ * every handler changes the tree or the Files table, and those hold
+ * tree_lock exclusively. The ones that only look hold it shared and
+ * run in parallel. Read, getattr and open wait for the disks: they
+ * drop the lock around the system calls on the real files, see
+ * dispatch_unlock(). The main loop holds it exclusively while it
+ * handles its other events, so inotify, the scan and the background
+ * jobs see the tree as before; a request that changed the tree wakes
+ * it up for the writeback and the invalidations.
+ */
+
+/* The start of every request, as in <linux/fuse.h> */
+struct request_header
+{
+	uint32_t len;
+	uint32_t opcode;
+	uint64_t unique;
+	uint64_t nodeid;
+	uint32_t uid, gid, pid, padding;
+};
+
+/* Opcodes of the requests that don't change anything */
+enum
+{
+	OP_LOOKUP = 1,
+	OP_FORGET = 2,
+	OP_GETATTR = 3,
+	OP_READLINK = 5,
+	OP_READ = 15,
+	OP_STATFS = 17,
+	OP_FLUSH = 25,
+	OP_OPENDIR = 27,
+	OP_READDIR = 28,
+	OP_RELEASEDIR = 29,
+	OP_ACCESS = 34,
+	OP_INTERRUPT = 36,
+	OP_BATCH_FORGET = 42,
+};
+
+struct request
+{
+	size_t len;
+	bool shared;
+	char buf[];
+};
+
+static struct workqueue *request_queue;
+static void (*process_fn)(char *buf, size_t len);
+
+/* The request this thread is processing, and does it hold tree_lock */
+static __thread struct request *current;
+static __thread bool holding;
+
+static bool is_shared (char *buf, size_t len)
+{
+	struct request_header *in = (struct request_header *)buf;
+
+	if (len < sizeof (*in))
+		return false;
+
+	switch (in->opcode)
+	{
+	case OP_LOOKUP:
+	case OP_FORGET:
+	case OP_GETATTR:
+	case OP_READLINK:
+	case OP_READ:
+	case OP_STATFS:
+	case OP_FLUSH:
+	case OP_OPENDIR:
+	case OP_READDIR:
+	case OP_RELEASEDIR:
+	case OP_ACCESS:
+	case OP_INTERRUPT:
+	case OP_BATCH_FORGET:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void lock_tree (void)
+{
+	if (current->shared)
+		pthread_rwlock_rdlock (&tree_lock);
+	else
+		pthread_rwlock_wrlock (&tree_lock);
+	holding = true;
+}
+
+static void process_request (void *data)
+{
+	current = data;
+	lock_tree ();
+	process_fn (current->buf, current->len);
+	dispatch_unlock ();
+	free (current);
+	current = NULL;
+}
+
+/* Done callback of the requests that may have left work for the main loop */
+static void tree_changed (void *data)
+{
+}
+
+/*
+ * Let the other requests have the tree while this one waits for the
+ * disk. Until dispatch_relock() the caller may use only what it has
+ * copied from the tree. Requests processed in the main loop keep it.
+ */
+void dispatch_unlock (void)
+{
+	if (holding)
+	{
+		pthread_rwlock_unlock (&tree_lock);
+		holding = false;
+	}
+}
+
+void dispatch_relock (void)
+{
+	if (current && ! holding)
+		lock_tree ();
+}
+
+/* Process the requests with NTHREADS threads; with one, in the main loop. */
+void dispatch_init (int nthreads, void (*process)(char *buf, size_t len))
+{
+	process_fn = process;
+	if (nthreads > 1)
+		request_queue = workqueue_new (nthreads, 4 * nthreads);
+}
+
+/* Process the request in BUF, which the caller may reuse at once. */
+void dispatch_request (char *buf, size_t len)
+{
+	struct request *req;
+
+	if (! request_queue)
+	{
+		process_fn (buf, len);
+		return;
+	}
+
+	req = malloc (sizeof (*req) + len);
+	if (! req)
+		abort ();
+	req->len = len;
+	req->shared = is_shared (buf, len);
+	memcpy (req->buf, buf, len);
+	workqueue_add (request_queue, process_request, req->shared ? NULL : tree_changed, req);
+}
+
+/* The main loop polls this for the requests processed by the threads; -1 without them. */
+int dispatch_fd (void)
+{
+	return request_queue ? workqueue_fd (request_queue) : -1;
+}
+
+void dispatch_complete (void)
+{
+	if (request_queue)
+		workqueue_complete (request_queue);
+}
+
+/* Wait for the requests in process and stop the threads. */
+void dispatch_destroy (void)
+{
+	if (request_queue)
+	{
+		workqueue_wait (request_queue);
+		workqueue_destroy (request_queue);
+		request_queue = NULL;
+	}
+}
+
+#ifdef DISPATCH_BENCH
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static double now (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#define READ_SIZE (128 * 1024)
+#define OP_OPEN 14
+
+static int fd;
+static off_t file_size;
+static int latency;		/* microseconds per read, like a disk seek */
+static long changes;		/* changed only with tree_lock exclusive */
+static bool keep_lock;		/* hold tree_lock during the I/O, as before */
+
+/* When each request was dispatched, and how long the readdirs waited */
+static double *dispatched;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double readdir_total, readdir_max;
+static int readdirs;
+
+/*
+ * A player reading a video: mostly reads, some getattrs, and an
+ * open and a release, which change the tree, now and then. Like
+ * file_read() and file_stat(), the reads and getattrs let go of
+ * the tree during the I/O.
+ */
+static void fake_process (char *buf, size_t len)
+{
+	struct request_header *in = (struct request_header *)buf;
+	char data[READ_SIZE];
+	struct stat st;
+	double waited;
+	long n;
+
+	switch (in->opcode)
+	{
+	case OP_READ:
+		if (! keep_lock)
+			dispatch_unlock ();
+		usleep (latency);
+		pread (fd, data, READ_SIZE, in->nodeid % (file_size / READ_SIZE) * READ_SIZE);
+		dispatch_relock ();
+		break;
+	case OP_GETATTR:
+		if (! keep_lock)
+			dispatch_unlock ();
+		fstat (fd, &st);
+		dispatch_relock ();
+		break;
+	case OP_READDIR:
+		/* The tree is in memory: all the time is spent waiting. */
+		waited = now () - dispatched[in->unique];
+		pthread_mutex_lock (&stats_lock);
+		readdir_total += waited;
+		if (waited > readdir_max)
+			readdir_max = waited;
+		readdirs++;
+		pthread_mutex_unlock (&stats_lock);
+		break;
+	default:
+		n = changes;
+		usleep (50);
+		changes = n + 1;
+		break;
+	}
+}
+
+/*
+ * ls in another directory while a player reads from a slow disk:
+ * with the lock held during a read, an open waiting for the reader
+ * makes every readdir after it wait too.
+ */
+static void slow_reader (int nthreads, int nrequests)
+{
+	int i;
+
+	readdir_total = readdir_max = 0.0;
+	readdirs = 0;
+	dispatch_init (nthreads, fake_process);
+	for (i = 0; i < nrequests; i++)
+	{
+		struct request_header in = { .len = sizeof (in), .nodeid = i, .unique = i };
+
+		in.opcode = i % 20 == 0 ? OP_READ : i % 20 == 1 ? OP_OPEN : OP_READDIR;
+		dispatched[i] = now ();
+		dispatch_request ((char *)&in, sizeof (in));
+		usleep (1000);
+	}
+	dispatch_destroy ();
+
+	printf ("%s the lock during reads: readdir waits %6.1f ms on average, %6.1f ms at most\n",
+		keep_lock ? "holding " : "dropping", readdir_total * 1e3 / readdirs, readdir_max * 1e3);
+}
+
+int main (int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "dispatchbench.data";
+	int nrequests = argc > 2 ? atoi (argv[2]) : 2000;
+	static int threads[] = { 1, 2, 4, 8, 16, 0 };
+	double base = 0.0;
+	int i, t;
+
+	latency = argc > 3 ? atoi (argv[3]) : 2000;
+
+	fd = open (file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror (file);
+		return 1;
+	}
+	file_size = 64 * READ_SIZE;
+	ftruncate (fd, file_size);
+
+	printf ("%d requests, %d us per read\n", nrequests, latency);
+	for (t = 0; threads[t]; t++)
+	{
+		long expected = 0;
+		double start, secs;
+
+		changes = 0;
+		dispatch_init (threads[t], fake_process);
+		start = now ();
+		for (i = 0; i < nrequests; i++)
+		{
+			struct request_header in = { .len = sizeof (in), .nodeid = i };
+
+			in.opcode = i % 50 == 0 ? OP_OPEN : i % 5 == 0 ? OP_GETATTR : OP_READ;
+			expected += in.opcode == OP_OPEN;
+			dispatch_request ((char *)&in, sizeof (in));
+
+			/* The main loop handles its own events now and then. */
+			if (i % 100 == 0)
+			{
+				pthread_rwlock_wrlock (&tree_lock);
+				pthread_rwlock_unlock (&tree_lock);
+			}
+		}
+		dispatch_destroy ();
+		secs = now () - start;
+
+		if (t == 0)
+			base = secs;
+		printf ("%2d threads: %8.0f requests/s  x%.1f%s\n", threads[t],
+			nrequests / secs, base / secs,
+			changes == expected ? "" : "  (lost updates!)");
+	}
+
+	/* A read taking 50 ms, like a disk spinning up or a network mount */
+	latency = argc > 4 ? atoi (argv[4]) : 50000;
+	dispatched = calloc (nrequests, sizeof (*dispatched));
+	if (! dispatched)
+		abort ();
+	printf ("\n4 threads, a readdir every ms, a %d us read every 20 ms followed by an open\n",
+		latency);
+	keep_lock = true;
+	slow_reader (4, nrequests > 500 ? 500 : nrequests);
+	keep_lock = false;
+	slow_reader (4, nrequests > 500 ? 500 : nrequests);
+	free (dispatched);
+
+	close (fd);
+	if (argc <= 1)
+		unlink (file);
+	return 0;
+}
+#endif /* DISPATCH_BENCH */
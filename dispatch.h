@@ -0,0 +1,15 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include <stdbool.h>
+#include <stddef.h>
+
+void dispatch_init (int nthreads, void (*process)(char *buf, size_t len));
+void dispatch_request (char *buf, size_t len);
+void dispatch_destroy (void);
+int dispatch_fd (void);
+void dispatch_complete (void);
+
+void dispatch_unlock (void);
+void dispatch_relock (void);
+
+#endif /* DISPATCH_H */
@@ -1,17 +1,37 @@
 /* entry.c - 24.7.2008 - 1.11.2008 Ari & Tero Roponen */
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "dispatch.h"
 #include "entry.h"
+#include "entrydb.h"
+#include "inval.h"
+#include "media.h"
 #include "util.h"
 
 struct atrfs_entry *root = NULL;
 
+/*
+ * Guards the tree: the directory contents, sha1_to_entry_map and the
+ * entries. Requests that only look at them hold it shared, anything
+ * that changes them holds it exclusively; see dispatch.c. Writers go
+ * first, so that a stream of reads can't keep the main loop waiting.
+ */
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
 static struct atrfs_entry_ops virtual_ops, file_ops, directory_ops;
 
+/*
+ * Name -> number of attached file and virtual entries of that name,
+ * in any directory. uniquify_name() needs names unique in the whole
+ * tree, and walking the tree for every new file made startup quadratic.
+ */
+static GHashTable *leaf_names;
+
 struct atrfs_entry *ino_to_entry(fuse_ino_t ino)
 {
 	struct atrfs_entry *ent = (struct atrfs_entry *)ino;
@@ -24,6 +44,19 @@ struct atrfs_entry *ino_to_entry(fuse_ino_t ino)
 	return ent;
 }
 
+/* Hash functions for tables keyed by binary SHA1s. */
+guint key_hash (gconstpointer key)
+{
+	guint h;
+	memcpy (&h, key, sizeof (h));
+	return h;
+}
+
+gboolean key_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, KEY_SIZE) == 0;
+}
+
 int get_watchcount(struct atrfs_entry *ent)
 {
 	return get_ivalue (ent, "count", 0);
@@ -34,32 +67,15 @@ double get_watchtime(struct atrfs_entry *ent)
 	return get_dvalue (ent, "watchtime", 0.0);
 }
 
+/* The length of ENT in seconds, or 0.0 until media.c has read it. */
 double get_length(struct atrfs_entry *ent)
 {
-	double value = get_dvalue (ent, "length", -1.0);
+	double value = get_dvalue (ent, "length", 0.0);
 	if (value <= 0.0)
 	{
-		char buf[256];
-		FILE *in;
-
-		snprintf(buf, sizeof(buf),
-			"mplayer -identify -frames 0 -ao null -vo null "
-			"2>/dev/null -- \"%s\"", REAL_NAME(ent));
-
-		in = popen(buf, "r");
-		while (fgets(buf, sizeof(buf), in))
-		{
-			if (strncmp(buf, "ID_LENGTH=", 10) == 0)
-			{
-				value = atof(buf + 10);
-				break;
-			}
-		}
-		pclose(in);
-
-		set_dvalue (ent, "length", value);
+		media_probe (ent);
+		value = 0.0;
 	}
-
 	return value;
 }
 
@@ -67,6 +83,7 @@ static void set_virtual_contents(struct atrfs_entry *ent, char *str, size_t sz)
 {
 	VIRTUAL_ENTRY(ent)->m_data = str;
 	VIRTUAL_ENTRY(ent)->m_size = sz;
+	inval_inode (ent);
 }
 
 static ssize_t virtual_read (struct atrfs_entry *ent, char *buf, size_t size, off_t offset)
@@ -80,7 +97,12 @@ static ssize_t virtual_read (struct atrfs_entry *ent, char *buf, size_t size, of
 
 static ssize_t file_read (struct atrfs_entry *ent, char *buf, size_t size, off_t offset)
 {
-	int ret = pread (FILE_ENTRY(ent)->fd, buf, size, offset);
+	int fd = FILE_ENTRY(ent)->fd;
+	int ret;
+
+	dispatch_unlock ();
+	ret = pread (fd, buf, size, offset);
+	dispatch_relock ();
 	return ret;
 }
 
@@ -100,6 +122,14 @@ struct atrfs_entry *create_entry (enum atrfs_entry_type type)
 			abort ();
 		fent->fd = -1;
 		fent->real_path = NULL;
+		fent->has_key = false;
+		memset (&fent->stamp, 0, sizeof (fent->stamp));
+		fent->provisional = false;
+		fent->probed = false;
+		fent->row = NULL;
+		fent->changed = COLUMN_ALL;
+		fent->filter_result = NULL;
+		fent->rank = NULL;
 		fent->start_time = -1.0;
 		fent->subtitles = NULL;
 		ent = &fent->entry;
@@ -123,6 +153,7 @@ struct atrfs_entry *create_entry (enum atrfs_entry_type type)
 			abort ();
 		ent = &dent->entry;
 		DIR_ENTRY(ent)->contents = g_hash_table_new (g_str_hash, g_str_equal);
+		clock_gettime (CLOCK_REALTIME, &DIR_ENTRY(ent)->mtime);
 		break;
 	}
 	}
@@ -162,6 +193,9 @@ void destroy_entry (struct atrfs_entry *ent)
 		g_hash_table_destroy (DIR_ENTRY(ent)->contents);
 		break;
 	case ATRFS_FILE_ENTRY:
+		free (FILE_ENTRY(ent)->filter_result);
+		unrank_entry (ent);
+		break;
 	case ATRFS_VIRTUAL_FILE_ENTRY:
 		break;
 	}
@@ -176,6 +210,35 @@ struct atrfs_entry *lookup_entry_by_name (struct atrfs_entry *dir, const char *n
 	return dir->ops->lookup_entry_by_name (dir, name);
 }
 
+static void count_leaf_name (struct atrfs_entry *ent, int delta)
+{
+	int count;
+
+	if (ent->e_type == ATRFS_DIRECTORY_ENTRY || ! ent->name)
+		return;
+	if (! leaf_names)
+		leaf_names = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+
+	count = GPOINTER_TO_INT (g_hash_table_lookup (leaf_names, ent->name)) + delta;
+	if (count > 0)
+		g_hash_table_replace (leaf_names, strdup (ent->name), GINT_TO_POINTER (count));
+	else
+		g_hash_table_remove (leaf_names, ent->name);
+}
+
+/* Is some file or virtual entry of the tree called NAME? */
+bool leaf_name_in_use (const char *name)
+{
+	return leaf_names && g_hash_table_lookup (leaf_names, name) != NULL;
+}
+
+/* The contents of DIR have changed: the kernel must stat it again. */
+static void touch_directory (struct atrfs_entry *dir)
+{
+	clock_gettime (CLOCK_REALTIME, &DIR_ENTRY(dir)->mtime);
+	inval_inode (dir);
+}
+
 /*
  * Attach the given entry to a given directory
  * and give it the specified name.
@@ -186,6 +249,8 @@ void attach_entry (struct atrfs_entry *dir, struct atrfs_entry *ent, char *name)
 	ent->name = strdup (name);
 	g_hash_table_replace (DIR_ENTRY(dir)->contents, ent->name, ent);
 	ent->parent = dir;
+	count_leaf_name (ent, 1);
+	touch_directory (dir);
 }
 
 /*
@@ -197,7 +262,12 @@ void detach_entry (struct atrfs_entry *ent)
 	ASSERT_TYPE (ent->parent, ATRFS_DIRECTORY_ENTRY);
 	char *name = ent->name;
 	if (name)
+	{
 		g_hash_table_remove (DIR_ENTRY(ent->parent)->contents, name);
+		inval_entry (ent->parent, name);
+	}
+	count_leaf_name (ent, -1);
+	touch_directory (ent->parent);
 	ent->parent = NULL;
 
 	free (ent->name);
@@ -208,6 +278,8 @@ void move_entry (struct atrfs_entry *ent, struct atrfs_entry *to)
 {
 	ASSERT_TYPE (to, ATRFS_DIRECTORY_ENTRY);
 	struct atrfs_entry *parent = ent->parent;
+	if (to == parent)
+		return;
 	char *name = strdup (ent->name);
 	detach_entry (ent);
 	attach_entry (to, ent, name);
@@ -232,9 +304,9 @@ static int directory_stat (struct atrfs_entry *ent, struct stat *st)
 	st->st_uid = getuid();
 	st->st_gid = getgid();
 	st->st_size = g_hash_table_size(DIR_ENTRY(ent)->contents);
-	st->st_atime =
-	st->st_mtime =
-	st->st_ctime = time (NULL);
+	st->st_atim =
+	st->st_mtim =
+	st->st_ctim = DIR_ENTRY(ent)->mtime;
 	return 0;
 }
 
@@ -259,13 +331,21 @@ static int virtual_stat (struct atrfs_entry *ent, struct stat *st)
 
 static int file_stat (struct atrfs_entry *ent, struct stat *st)
 {
-	char *filename = REAL_NAME(ent);
-	if (stat (filename, st) < 0)
-		return errno;
-
-	st->st_nlink = get_watchcount (ent);
+	char filename[strlen (REAL_NAME(ent)) + 1];
+	int count = get_watchcount (ent);
+	double watchtime = get_watchtime (ent);
+	int ret;
+
+	strcpy (filename, REAL_NAME(ent));
+	dispatch_unlock ();
+	ret = stat (filename, st) < 0 ? errno : 0;
+	dispatch_relock ();
+	if (ret)
+		return ret;
+
+	st->st_nlink = count;
 	/* start at 1.1.2000 */
-	st->st_mtime = (time_t)(get_watchtime (ent) + 946677600.0);
+	st->st_mtime = (time_t)(watchtime + 946677600.0);
 	st->st_ino = (ino_t)(unsigned long)ent;
 	return 0;
 }
@@ -325,3 +405,237 @@ static struct atrfs_entry_ops directory_ops =
 	.stat = directory_stat,
 	.lookup_entry_by_name = directory_lookup_entry_by_name,
 };
+
+#if defined (ENTRY_BENCH) || defined (SPLICE_BENCH)
+#include <time.h>
+#include "idcache.h"
+#include "sha1.h"
+
+/* The benchmarks are linked without main.c, idcache.c, statistics.c and dispatch.c. */
+unsigned char *get_sha1_fast_r (char *filename, unsigned char *key)
+{
+	return get_sha1_r (filename, key);
+}
+
+void categorize_file_entry (struct atrfs_entry *ent)
+{
+}
+
+void dispatch_unlock (void)
+{
+}
+
+void dispatch_relock (void)
+{
+}
+
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+#ifdef ENTRY_BENCH
+
+/* This is how uniquify_name() found a free name before leaf_names. */
+static char *old_uniquify_name (char *name, struct atrfs_entry *root)
+{
+	char *uniq = strdup (name);
+
+	int globally_unique (struct atrfs_entry *ent)
+	{
+		if (strcmp (uniq, ent->name) == 0)
+			return 1;
+		return 0;
+	}
+
+	int len = strlen (name);
+	char *ext = strrchr (name, '.');
+	if (! ext)
+		ext = name + strlen (name);
+
+	int i;
+	for (i = 2;; i++)
+	{
+		if (map_leaf_entries (root, globally_unique) == 0)
+		{
+			return uniq;
+		} else {
+			char buf[len + 10];
+			sprintf (buf, "%.*s %d%s", (int)(ext - name), name, i, ext);
+			free (uniq);
+			uniq = strdup (buf);
+		}
+	}
+}
+
+/*
+ * Name and attach NFILES file entries like the scan does. Half of the
+ * names are used twice and every hundredth file is "video.flv".
+ */
+static double add_files (int nfiles, bool old)
+{
+	struct atrfs_entry *dir = create_entry (ATRFS_DIRECTORY_ENTRY);
+	struct atrfs_entry **ents = malloc (nfiles * sizeof (*ents));
+	double start;
+	int i;
+
+	root = create_entry (ATRFS_DIRECTORY_ENTRY);
+	attach_entry (root, dir, "category");
+
+	start = now ();
+	for (i = 0; i < nfiles; i++)
+	{
+		char name[64], *uniq;
+
+		if (i % 100 == 0)
+			strcpy (name, "video.flv");
+		else
+			sprintf (name, "clip %d.flv", i % (nfiles / 2));
+		uniq = old ? old_uniquify_name (name, root) : uniquify_name (name);
+		ents[i] = create_entry (ATRFS_FILE_ENTRY);
+		/* Every tenth file goes to a category, as in a real tree. */
+		attach_entry (i % 10 ? root : dir, ents[i], uniq);
+		free (uniq);
+	}
+	start = now () - start;
+
+	for (i = 0; i < nfiles; i++)
+	{
+		detach_entry (ents[i]);
+		destroy_entry (ents[i]);
+	}
+	detach_entry (dir);
+	destroy_entry (dir);
+	destroy_entry (root);
+	free (ents);
+	if (leaf_names && g_hash_table_size (leaf_names))
+	{
+		printf ("%u names left in leaf_names\n", g_hash_table_size (leaf_names));
+		exit (1);
+	}
+	return start;
+}
+
+int main (int argc, char *argv[])
+{
+	int sizes[] = { 10000, 100000, 1000000 };
+	int old_limit = argc > 1 ? atoi (argv[1]) : 10000;
+	int i;
+
+	printf ("%8s %12s %12s\n", "files", "old (s)", "new (s)");
+	for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+	{
+		double t_new = add_files (sizes[i], false);
+		if (sizes[i] <= old_limit)
+			printf ("%8d %12.3f %12.3f\n", sizes[i], add_files (sizes[i], true), t_new);
+		else
+			printf ("%8d %12s %12.3f\n", sizes[i], "-", t_new);
+	}
+	return 0;
+}
+#endif /* ENTRY_BENCH */
+
+#ifdef SPLICE_BENCH
+#include <fcntl.h>
+
+#define CHUNK (128 * 1024)
+
+/*
+ * Read ENT from start to end in requests of CHUNK bytes and write the
+ * data to a pipe, as the replies go to /dev/fuse: copied through
+ * file_read() like fuse_reply_buf() does, or spliced from the file
+ * like fuse_reply_data() does. Return the MB/s.
+ */
+static double pass_file (struct atrfs_entry *ent, off_t size, bool use_splice)
+{
+	static char buf[CHUNK];
+	int null = open ("/dev/null", O_WRONLY);
+	int p[2];
+	double start;
+	off_t off;
+
+	if (null < 0 || pipe (p) < 0)
+		abort ();
+	fcntl (p[1], F_SETPIPE_SZ, CHUNK);
+
+	start = now ();
+	for (off = 0; off < size; )
+	{
+		ssize_t n;
+
+		if (use_splice)
+		{
+			loff_t pos = off;
+			n = splice (FILE_ENTRY(ent)->fd, &pos, p[1], NULL, CHUNK, SPLICE_F_MOVE);
+		} else {
+			n = ent->ops->read (ent, buf, CHUNK, off);
+			if (n > 0)
+				n = write (p[1], buf, n);
+		}
+		if (n <= 0)
+			break;
+		off += n;
+
+		/* The kernel takes the reply. */
+		while (n > 0)
+		{
+			ssize_t m = splice (p[0], NULL, null, NULL, n, SPLICE_F_MOVE);
+			if (m <= 0)
+				abort ();
+			n -= m;
+		}
+	}
+	start = now () - start;
+
+	close (p[0]);
+	close (p[1]);
+	close (null);
+	return off / 1e6 / start;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "splicebench.data";
+	off_t size = (argc > 2 ? atoi (argv[2]) : 256) * 1024 * 1024;
+	struct atrfs_entry *ent = create_entry (ATRFS_FILE_ENTRY);
+	struct stat st;
+	int i;
+
+	FILE_ENTRY(ent)->fd = open (file, O_RDWR | O_CREAT, 0644);
+	if (FILE_ENTRY(ent)->fd < 0)
+	{
+		perror (file);
+		return 1;
+	}
+	fstat (FILE_ENTRY(ent)->fd, &st);
+	if (st.st_size < size)
+	{
+		/* Real data, so that the pages are in the page cache. */
+		static char buf[CHUNK];
+		off_t off;
+		for (off = 0; off < size; off += CHUNK)
+		{
+			memset (buf, off / CHUNK, CHUNK);
+			pwrite (FILE_ENTRY(ent)->fd, buf, CHUNK, off);
+		}
+	} else
+		size = st.st_size;
+
+	/* From the page cache: the difference is the copying alone. */
+	printf ("%.0f MB in %d KB reads\n", size / 1e6, CHUNK / 1024);
+	for (i = 0; i < 3; i++)
+	{
+		double copy = pass_file (ent, size, false);
+		double spliced = pass_file (ent, size, true);
+		printf ("pread + write %8.0f MB/s   splice %8.0f MB/s\n", copy, spliced);
+	}
+
+	close (FILE_ENTRY(ent)->fd);
+	if (argc <= 1)
+		unlink (file);
+	return 0;
+}
+#endif /* SPLICE_BENCH */
@@ -3,8 +3,12 @@
 #define ENTRY_H
 #include <fuse/fuse_lowlevel.h>
 #include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <time.h>
+#include "sha1.h"
 
 #define ASSERT_TYPE(ent,type) do { if (!(ent) || (ent)->e_type != (type)) abort ();} while(0)
 #define VIRTUAL_ENTRY(ent) ((struct atrfs_virtual_entry*)(ent))
@@ -39,11 +43,37 @@ struct atrfs_entry
 	struct atrfs_entry_ops *ops;
 };
 
+/* What a key was computed from: the file is rehashed if it differs. */
+struct file_stamp
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+};
+
 struct atrfs_file_entry
 {
 	struct atrfs_entry entry;
 	int fd;
 	char *real_path;
+	/*
+	 * Files key: the SHA1 (or in fingerprint mode, maybe the
+	 * fingerprint) of real_path. It is resolved when the entry is
+	 * created and changed only when inotify reports the file as
+	 * rewritten.
+	 */
+	unsigned char key[KEY_SIZE];
+	bool has_key;
+	struct file_stamp stamp;	/* of real_path when key was computed */
+	bool provisional;	/* key is a fingerprint waiting for verification */
+	bool probed;		/* media properties of key queued, see media.c */
+	struct file_row *row;	/* in-memory Files row of key */
+	/* COLUMN_* bits changed since the category was last decided */
+	unsigned int changed;
+	char **filter_result;	/* category given by each filter, or NULL */
+	GSequenceIter *rank;	/* place in the watchtime ranking, see util.c */
+	double ranked_watchtime;
 	double start_time;
 	struct atrfs_entry *subtitles;
 };
@@ -61,6 +91,7 @@ struct atrfs_directory_entry
 {
 	struct atrfs_entry entry;
 	GHashTable *contents;
+	struct timespec mtime;	/* when contents last changed */
 };
 
 enum
@@ -71,9 +102,13 @@ enum
 };
 
 extern struct atrfs_entry *root;
+extern pthread_rwlock_t tree_lock;
 
 struct atrfs_entry *ino_to_entry(fuse_ino_t ino);
 
+guint key_hash (gconstpointer key);
+gboolean key_equal (gconstpointer a, gconstpointer b);
+
 struct atrfs_entry *create_entry (enum atrfs_entry_type type);
 void destroy_entry (struct atrfs_entry *ent);
 
@@ -83,6 +118,7 @@ int map_leaf_entries (struct atrfs_entry *root, int (*fn) (struct atrfs_entry *e
 void attach_entry (struct atrfs_entry *dir, struct atrfs_entry *ent, char *name);
 void detach_entry (struct atrfs_entry *ent);
 void move_entry (struct atrfs_entry *ent, struct atrfs_entry *to);
+bool leaf_name_in_use (const char *name);
 
 char *get_real_file_name(struct atrfs_entry *ent);
 
@@ -6,37 +6,80 @@
 #include "entrydb.h"
 #include "entry_filter.h"
 
-extern char *get_sha1_fast (char *filename);
-GHashTable *sha1_to_entry_map;
-
 struct filter
 {
 	char *str;
+	int index;		/* in filter_result of file entries */
+	bool analyzed;
+	unsigned int columns;	/* COLUMN_* bits the filter reads */
 	struct filter *next;
 };
 
 static struct filter *filters;
+static int nfilters;
+
+/* Key -> filter_result, while all files are categorized at once */
+static GHashTable *category_map;
+
+/* Category names, shared by the filter_result of all entries */
+static GHashTable *category_names;
 
+/* Filter runs for single files, and the ones that were not needed */
+static unsigned long evaluations, evaluations_saved;
+
+/* Filters must be added before any file entry is categorized. */
 void add_filter (char *str)
 {
 	struct filter *filt = malloc (sizeof (*filt));
 	if (filt)
 	{
 		filt->str = strdup (str);
+		filt->index = nfilters++;
+		filt->analyzed = false;
+		filt->columns = COLUMN_ALL;
 		filt->next = filters;
 		filters = filt;
 	}
 }
 
-static char *get_catfile (struct atrfs_entry *ent)
+static unsigned int filter_columns (struct filter *filt)
 {
-	static char *catfile = NULL;
-	if (catfile)
+	if (! filt->analyzed)
 	{
-		free (catfile);
-		catfile = NULL;
+		filt->columns = entrydb_columns_of (filt->str);
+		filt->analyzed = true;
+		tmplog ("filter %d reads columns %#x\n", filt->index, filt->columns);
 	}
+	return filt->columns;
+}
+
+static char *intern_category (char *c)
+{
+	char *name;
 
+	if (! category_names)
+		category_names = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+	name = g_hash_table_lookup (category_names, c);
+	if (! name)
+	{
+		name = strdup (c);
+		g_hash_table_insert (category_names, name, name);
+	}
+	return name;
+}
+
+static char **new_filter_result (void)
+{
+	char **result = calloc (nfilters ? nfilters : 1, sizeof (char *));
+	if (! result)
+		abort ();
+	return result;
+}
+
+/* The category from cat.txt next to ENT, or NULL. The caller frees it. */
+static char *get_catfile (struct atrfs_entry *ent)
+{
+	char *catfile = NULL;
 	char buf[256];
 	char *s;
 	strcpy (buf, REAL_NAME(ent));
@@ -61,36 +104,147 @@ static char *get_catfile (struct atrfs_entry *ent)
 	return catfile;
 }
 
-char *get_category (struct atrfs_entry *ent)
+/*
+ * Run every filter once over the whole table and remember what each
+ * filter gave for each key. Until forget_categories() get_category()
+ * only looks the results up.
+ */
+void prepare_categories (void)
+{
+	struct filter *filt;
+
+	void add_category (char *c, unsigned char *key)
+	{
+		if (! c)
+		{
+			tmplog ("get_category: ncols != 2\n");
+			return;
+		}
+		char **result = g_hash_table_lookup (category_map, key);
+		if (! result)
+		{
+			unsigned char *k = malloc (KEY_SIZE);
+			if (! k)
+				abort ();
+			memcpy (k, key, KEY_SIZE);
+			result = new_filter_result ();
+			g_hash_table_insert (category_map, k, result);
+		}
+		result[filt->index] = intern_category (c);
+	}
+
+	forget_categories ();
+	category_map = g_hash_table_new_full (key_hash, key_equal, free, free);
+	for (filt = filters; filt; filt = filt->next)
+		entrydb_foreach_key (filt->str, add_category);
+}
+
+void forget_categories (void)
+{
+	if (category_map)
+		g_hash_table_destroy (category_map);
+	category_map = NULL;
+}
+
+/*
+ * Could a filter give ENT another category now? Only the columns
+ * changed since the last time can make a difference.
+ */
+bool category_may_change (struct atrfs_entry *ent)
 {
+	struct atrfs_file_entry *fent = FILE_ENTRY(ent);
 	struct filter *filt;
-	char *cat = NULL;
 
-	int filter_cb (void *data, int ncols, char **values, char **names)
+	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
+
+	if (! fent->filter_result)
+		return true;
+	for (filt = filters; filt; filt = filt->next)
 	{
-		if (ncols != 2)
+		if (fent->changed & filter_columns (filt))
+			return true;
+	}
+
+	evaluations_saved += nfilters;
+	fent->changed = 0;
+	return false;
+}
+
+/* Run the filters of ENT again that read one of its changed columns. */
+static void evaluate_filters (struct atrfs_file_entry *fent)
+{
+	struct filter *filt;
+	char **res;
+
+	void filter_cb (char *c, unsigned char *key)
+	{
+		if (! c)
+		{
 			tmplog ("get_category: ncols != 2\n");
+			return;
+		}
+		*res = intern_category (c);
+	}
 
-		char *c = values[0];
-		struct atrfs_entry *e = g_hash_table_lookup (sha1_to_entry_map, values[1]);
-		if (ent == e)
-			cat = strdup (c);
-		return 0;
+	for (filt = filters; filt; filt = filt->next)
+	{
+		if (! (fent->changed & filter_columns (filt)))
+		{
+			evaluations_saved++;
+			continue;
+		}
+
+		/* select "uudet", sha1 from Files where count = 0; */
+		res = &fent->filter_result[filt->index];
+		*res = NULL;
+		entrydb_foreach_key_of (filt->str, fent->key, filter_cb);
+		evaluations++;
 	}
+}
+
+char *get_category (struct atrfs_entry *ent)
+{
+	struct atrfs_file_entry *fent = FILE_ENTRY(ent);
+	struct filter *filt;
+	char *cat;
 
 	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
 
 	/* Category file cat.txt will always take precedence. */
 	cat = get_catfile (ent);
 	if (cat)
-		return strdup (cat);
+		return cat;
 
-	for (filt = filters; !cat && filt; filt = filt->next)
+	if (! fent->filter_result)
 	{
-		/* select "uudet", sha1 from Files where count = 0; */
-		if (entrydb_exec (filter_cb, filt->str) && cat)
-			return cat;
+		fent->filter_result = new_filter_result ();
+		fent->changed = COLUMN_ALL;
 	}
 
-	return cat;
+	if (category_map && fent->has_key)
+	{
+		char **result = g_hash_table_lookup (category_map, fent->key);
+		if (result)
+			memcpy (fent->filter_result, result, nfilters * sizeof (char *));
+		else
+			memset (fent->filter_result, 0, nfilters * sizeof (char *));
+	} else {
+		evaluate_filters (fent);
+	}
+	fent->changed = 0;
+
+	/* The first matching filter wins. */
+	for (filt = filters; filt; filt = filt->next)
+	{
+		cat = fent->filter_result[filt->index];
+		if (cat)
+			return strdup (cat);
+	}
+	return NULL;
+}
+
+void get_filter_stats (unsigned long *evaluated, unsigned long *saved)
+{
+	*evaluated = evaluations;
+	*saved = evaluations_saved;
 }
@@ -6,5 +6,9 @@
 
 void add_filter (char *str);
 char *get_category (struct atrfs_entry *ent);
+void prepare_categories (void);
+void forget_categories (void);
+bool category_may_change (struct atrfs_entry *ent);
+void get_filter_stats (unsigned long *evaluated, unsigned long *saved);
 
 #endif /* ! ENTRY_FILTER_H */
@@ -1,35 +1,291 @@
 /* entrydb.c - 10.5.2010 - 9.7.2010 Ari & Tero Roponen */
 #include <sqlite3.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "entrydb.h"
+#include "idcache.h"
+#include "sha1.h"
 
-/* In sha1.c */
-char *get_sha1 (char *filename);
+/*
+ * Files are keyed by their binary SHA1. The table has no rowid,
+ * so the key is stored only once, in the primary key B-tree.
+ */
+#define FILES_SCHEMA \
+	"CREATE TABLE Files (sha1 BLOB PRIMARY KEY, count INT DEFAULT 0," \
+	" watchtime REAL DEFAULT 0.0, length REAL DEFAULT 0.0," \
+	" fingerprint BLOB) WITHOUT ROWID;"
 
 static sqlite3 *entrydb;
 
-char *get_sha1_fast (char *filename)
+/*
+ * All writes are done by a writer thread on a connection of its own.
+ * The database is in WAL mode: the FUSE thread reads while the writer
+ * commits, and with synchronous=NORMAL a commit doesn't wait for the
+ * disk; the WAL is synced when the writer checkpoints it.
+ */
+static sqlite3 *writedb;
+static pthread_t writer;
+
+struct write_job
+{
+	GPtrArray *inserts;	/* struct file_rows to insert, and/or */
+	GHashTable *attrs;	/* dirty attributes to store, or */
+	char *sql;		/* SQL to execute */
+	bool checkpoint;	/* checkpoint after the commit */
+	unsigned int serial;	/* jobs are numbered from 1 in submission order */
+	struct write_job *next;
+};
+
+/*
+ * Jobs waiting for the writer and jobs it is writing. Until they are
+ * committed their attribute values are read from here.
+ */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t written_cond = PTHREAD_COND_INITIALIZER;
+static struct write_job *queue_head, *queue_tail, *writing;
+static unsigned int submitted, committed;	/* serials of the last jobs */
+static bool writer_quit;
+static char *writer_filename;
+
+/*
+ * FUSE threads holding tree_lock shared read attributes and run
+ * queries at the same time. Finding the row, the prepared SELECTs
+ * and the temporary tables are not safe for that, so the reads are
+ * serialized here; the writes are done only with tree_lock held
+ * exclusively.
+ */
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Attribute name -> prepared SELECT of the reading connection */
+static GHashTable *get_stmts;
+
+/* SQL -> the same query limited to one key, see entrydb_foreach_key_of */
+static GHashTable *key_stmts;
+
+/* Attribute name -> prepared UPDATE, used only by the writer */
+static GHashTable *put_stmts;
+static sqlite3_stmt *insert_stmt;
+
+/*
+ * The whole Files table is read into memory when the database is
+ * opened, so that reading the attributes of a file needs no query.
+ * Rows of new files are inserted in batches by the writer.
+ */
+static GHashTable *rows;	/* key -> struct file_row */
+static struct file_row *loaded_rows;
+static GPtrArray *created_rows;	/* rows allocated after loading */
+static GPtrArray *new_rows;	/* rows waiting for insertion */
+
+/*
+ * Attribute writes and new rows are collected here and given to the
+ * writer in one batch, when there are WRITEBACK_MAX of them, when the
+ * oldest one is WRITEBACK_DELAY seconds old, on fsync and on unmount.
+ */
+#define WRITEBACK_MAX 256
+#define WRITEBACK_DELAY 5
+
+/*
+ * A batch that can't be committed, because another program holds the
+ * database or the disk is full, is tried again every WRITE_RETRY_DELAY
+ * seconds. When closing the database, it is given up after
+ * WRITE_RETRIES tries.
+ */
+#define WRITE_RETRY_DELAY 1
+#define WRITE_RETRIES 10
+
+struct dirty_attr
+{
+	unsigned char key[KEY_SIZE];
+	char *attr;		/* the key of get_stmts */
+	bool is_double;
+	int ival;
+	double dval;
+};
+
+/* struct dirty_attr -> itself */
+static GHashTable *dirty;
+static struct timespec dirty_since;
+
+/*
+ * The reading connection sees Files through a temporary view of the
+ * same name: the committed rows, except those whose key is in Hidden,
+ * and the rows in Pending. refresh_pending() fills these two tables
+ * with the rows as they will be once the writer has committed, so
+ * that queries need not wait for it.
+ */
+struct override
+{
+	unsigned char key[KEY_SIZE];
+	unsigned char src[KEY_SIZE];	/* the committed row to start from */
+	unsigned char fingerprint[KEY_SIZE];
+	bool has_fingerprint;
+	bool gone;		/* rekeyed away: the row is hidden */
+	unsigned int serial;	/* the job committing the last change */
+	unsigned int moved;	/* the job moving SRC to KEY, or 0 */
+};
+
+static GHashTable *overrides;	/* key -> struct override */
+static bool overrides_stale;
+static unsigned int refreshed;	/* committed at the last refresh */
+
+/* Attribute name or SQL -> prepared statement on the temporary tables */
+static GHashTable *pending_stmts;
+
+static bool have_pending (void);
+static void submit_pending (void);
+static unsigned int next_serial (void);
+static struct override *note_override (unsigned char *key, unsigned int serial);
+
+/* Return the key of ENT in the Files table, or NULL if the file can't be read. */
+static unsigned char *entry_key (struct atrfs_entry *ent)
+{
+	if (! FILE_ENTRY(ent)->has_key)
+	{
+		if (! get_sha1_fast_r (REAL_NAME (ent), FILE_ENTRY(ent)->key))
+			return NULL;
+		FILE_ENTRY(ent)->has_key = true;
+		FILE_ENTRY(ent)->row = NULL;
+	}
+	return FILE_ENTRY(ent)->key;
+}
+
+/*
+ * Return the row of KEY. If CREATE, a missing row is made with the
+ * default values and inserted into the database later.
+ */
+static struct file_row *find_row (unsigned char *key, bool create)
+{
+	struct file_row *row;
+
+	if (! rows)
+		return NULL;
+
+	row = g_hash_table_lookup (rows, key);
+	if (! row && create)
+	{
+		row = calloc (1, sizeof (*row));
+		if (! row)
+			abort ();
+		memcpy (row->key, key, KEY_SIZE);
+		g_hash_table_insert (rows, row->key, row);
+		g_ptr_array_add (created_rows, row);
+		note_override (key, next_serial ());
+
+		if (! have_pending ())
+			clock_gettime (CLOCK_MONOTONIC, &dirty_since);
+		if (! new_rows)
+			new_rows = g_ptr_array_new ();
+		g_ptr_array_add (new_rows, row);
+		if (new_rows->len + (dirty ? g_hash_table_size (dirty) : 0) >= WRITEBACK_MAX)
+			submit_pending ();
+	}
+	return row;
+}
+
+/* Return the row of ENT, which is remembered in the entry. */
+static struct file_row *entry_row (struct atrfs_entry *ent)
+{
+	unsigned char *key = entry_key (ent);
+
+	if (! FILE_ENTRY(ent)->row)
+		FILE_ENTRY(ent)->row = find_row (key, true);
+	return FILE_ENTRY(ent)->row;
+}
+
+/* Read the Files table into memory in one pass. */
+static bool load_rows (void)
 {
-	int len = getxattr (filename, "user.sha1", NULL, 0);
-	static char *sha1;
-	static char buf[32];
+	sqlite3_stmt *stmt = NULL;
+	int n = 0, size = 0;
+
+	if (sqlite3_prepare_v2 (entrydb, "SELECT count(*) FROM Files;", -1, &stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step (stmt) == SQLITE_ROW)
+		size = sqlite3_column_int (stmt, 0);
+	sqlite3_finalize (stmt);
+
+	rows = g_hash_table_new (key_hash, key_equal);
+	created_rows = g_ptr_array_new ();
+	loaded_rows = calloc (size ? size : 1, sizeof (*loaded_rows));
+	if (! loaded_rows)
+		abort ();
 
-	sha1 = NULL;
-	if (len <= 0)
+	if (sqlite3_prepare_v2 (entrydb, "SELECT sha1, count, watchtime, length FROM Files;",
+				-1, &stmt, NULL) != SQLITE_OK)
 	{
-		sha1 = get_sha1 (filename);
-		if (setxattr (filename, "user.sha1", sha1, strlen (sha1) + 1, 0))
-			perror ("Can't set SHA1");
+		tmplog ("%s while loading Files\n", sqlite3_errmsg (entrydb));
+		return false;
 	}
 
-	if (! sha1)
+	while (n < size && sqlite3_step (stmt) == SQLITE_ROW)
 	{
-		getxattr (filename, "user.sha1", buf, len);
-		sha1 = buf;
+		struct file_row *row = &loaded_rows[n];
+
+		if (sqlite3_column_bytes (stmt, 0) != KEY_SIZE)
+			continue;
+
+		memcpy (row->key, sqlite3_column_blob (stmt, 0), KEY_SIZE);
+		row->count = sqlite3_column_int (stmt, 1);
+		row->watchtime = sqlite3_column_double (stmt, 2);
+		row->length = sqlite3_column_double (stmt, 3);
+		g_hash_table_insert (rows, row->key, row);
+		n++;
 	}
-	return sha1;
+	sqlite3_finalize (stmt);
+
+	tmplog ("Loaded %d files from the database\n", n);
+	return true;
+}
+
+static void free_rows (void)
+{
+	int i;
+
+	if (! rows)
+		return;
+
+	for (i = 0; i < created_rows->len; i++)
+		free (g_ptr_array_index (created_rows, i));
+	g_ptr_array_free (created_rows, TRUE);
+	g_hash_table_destroy (rows);
+	free (loaded_rows);
+	rows = NULL;
+	created_rows = NULL;
+	loaded_rows = NULL;
+}
+
+/* Point IVAL or DVAL to the in-memory value of ATTR in ROW, if there is one. */
+static bool row_attr (struct file_row *row, char *attr, int **ival, double **dval)
+{
+	*ival = NULL;
+	*dval = NULL;
+	if (! row)
+		return false;
+
+	if (strcmp (attr, "count") == 0)
+		*ival = &row->count;
+	else if (strcmp (attr, "watchtime") == 0)
+		*dval = &row->watchtime;
+	else if (strcmp (attr, "length") == 0)
+		*dval = &row->length;
+	return *ival || *dval;
+}
+
+/* atrfs_unhex(text): the key that TEXT is the hex form of, or NULL. */
+static void sql_unhex (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *hex = (const char *)sqlite3_value_text (argv[0]);
+	unsigned char key[KEY_SIZE];
+
+	if (hex && hex_to_key (hex, key))
+		sqlite3_result_blob (ctx, key, KEY_SIZE, SQLITE_TRANSIENT);
+	else
+		sqlite3_result_null (ctx);
 }
 
 bool entrydb_exec (int (*callback)(void *data, int ncols, char **values, char **names), char *cmdfmt, ...)
@@ -53,91 +309,1683 @@ bool entrydb_exec (int (*callback)(void *data, int ncols, char **values, char **
 	return ret;
 }
 
-bool open_entrydb (char *filename)
+/* Does the Files table have COLUMN (of TYPE, unless NULL)? */
+static bool has_column (char *column, char *type)
 {
-	sqlite3 *handle = NULL;
-	char *err;
-	bool must_create = false;
+	sqlite3_stmt *stmt = NULL;
+	bool ret = false;
 
-	if (access (filename, F_OK) != 0)
-		must_create = true;
+	if (sqlite3_prepare_v2 (entrydb, "SELECT type FROM pragma_table_info('Files')"
+				" WHERE name=?1", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		sqlite3_bind_text (stmt, 1, column, -1, SQLITE_STATIC);
+		if (sqlite3_step (stmt) == SQLITE_ROW)
+			ret = ! type || strcasecmp ((char *)sqlite3_column_text (stmt, 0), type) == 0;
+	}
+	sqlite3_finalize (stmt);
+	return ret;
+}
 
-	sqlite3_open (filename, &handle);
-	if (must_create)
+/*
+ * Version 1: binary keys. Version 0 databases have hex string keys,
+ * no primary key and may lack the later columns.
+ */
+static bool upgrade_to_1 (void)
+{
+	if (! has_column ("watchtime", NULL) &&
+	    ! entrydb_exec (NULL, "ALTER TABLE Files ADD watchtime REAL DEFAULT 0.0;"))
+		return false;
+	if (! has_column ("length", NULL) &&
+	    ! entrydb_exec (NULL, "ALTER TABLE Files ADD length REAL DEFAULT 0.0;"))
+		return false;
+	if (! has_column ("fingerprint", NULL) &&
+	    ! entrydb_exec (NULL, "ALTER TABLE Files ADD fingerprint TEXT;"))
+		return false;
+
+	/* Databases made before versioning may have binary keys already. */
+	if (! has_column ("sha1", "TEXT"))
+		return true;
+
+	return entrydb_exec (NULL,
+			     "ALTER TABLE Files RENAME TO OldFiles;"
+			     FILES_SCHEMA
+			     "INSERT INTO Files (sha1, count, watchtime, length, fingerprint)"
+			     " SELECT atrfs_unhex(sha1), count, watchtime, length,"
+			     " atrfs_unhex(fingerprint) FROM OldFiles"
+			     " WHERE atrfs_unhex(sha1) IS NOT NULL"
+			     " ON CONFLICT(sha1) DO UPDATE SET"
+			     " count = count + excluded.count,"
+			     " watchtime = watchtime + excluded.watchtime,"
+			     " length = max(length, excluded.length);"
+			     "DROP TABLE OldFiles;");
+}
+
+/* Version 2: indexes for the listing by watchtime and for filters. */
+static bool upgrade_to_2 (void)
+{
+	return entrydb_exec (NULL,
+			     "CREATE INDEX IF NOT EXISTS Files_watchtime ON Files (watchtime);"
+			     "CREATE INDEX IF NOT EXISTS Files_count ON Files (count);");
+}
+
+/* Version 3: media properties, see media.c. NULL until a file is probed. */
+static bool upgrade_to_3 (void)
+{
+	return entrydb_exec (NULL,
+			     "ALTER TABLE Files ADD width INT;"
+			     "ALTER TABLE Files ADD height INT;"
+			     "ALTER TABLE Files ADD codec INT;"
+			     "ALTER TABLE Files ADD keyframes INT;");
+}
+
+/*
+ * The schema version is kept in PRAGMA user_version and
+ * upgrades[N] brings a database from version N to N + 1.
+ */
+static bool (*upgrades[])(void) = {
+	upgrade_to_1,
+	upgrade_to_2,
+	upgrade_to_3,
+};
+
+#define SCHEMA_VERSION ((int)(sizeof (upgrades) / sizeof (upgrades[0])))
+
+static int schema_version (void)
+{
+	sqlite3_stmt *stmt = NULL;
+	int version = -1;
+
+	if (sqlite3_prepare_v2 (entrydb, "PRAGMA user_version;", -1, &stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step (stmt) == SQLITE_ROW)
+		version = sqlite3_column_int (stmt, 0);
+	sqlite3_finalize (stmt);
+	return version;
+}
+
+/* Upgrade the database to SCHEMA_VERSION, one version per transaction. */
+static bool upgrade_schema (char *filename)
+{
+	int version = schema_version ();
+	bool converted = version == 0;
+
+	if (version < 0 || version > SCHEMA_VERSION)
+	{
+		tmplog ("%s: unknown schema version %d\n", filename, version);
+		return false;
+	}
+
+	for (; version < SCHEMA_VERSION; version++)
 	{
-		entrydb = handle; /* Hack! */
-		if (! entrydb_exec (NULL,
-				    "CREATE TABLE Files (sha1 TEXT, count INT DEFAULT 0);"
-				    "ALTER TABLE Files ADD watchtime REAL DEFAULT 0.0;"
-				    "ALTER TABLE Files ADD length REAL DEFAULT 0.0;"
-				    //"INSERT INTO Files (File) VALUES (\"oma.flv\");"
-			    ))
+		tmplog ("Upgrading %s to schema version %d\n", filename, version + 1);
+		if (! entrydb_exec (NULL, "BEGIN;") ||
+		    ! upgrades[version] () ||
+		    ! entrydb_exec (NULL, "PRAGMA user_version = %d; COMMIT;", version + 1))
 		{
-			sqlite3_close (handle);
-			entrydb = NULL;
+			entrydb_exec (NULL, "ROLLBACK;");
 			return false;
 		}
+	}
 
-		tmplog ("Created database: %s\n", filename);
+	/* Rebuilding the table left the old pages free. */
+	if (converted)
+		entrydb_exec (NULL, "VACUUM;");
+	return true;
+}
+
+/* Prepare SQL on DB and keep the statement in CACHE under ATTR. */
+static sqlite3_stmt *cached_stmt (sqlite3 *db, GHashTable *cache, char *attr, char *fmt)
+{
+	sqlite3_stmt *stmt = g_hash_table_lookup (cache, attr);
+	char *sql = NULL;
+
+	if (stmt)
+		return stmt;
+
+	asprintf (&sql, fmt, attr);
+	if (sqlite3_prepare_v3 (db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+				&stmt, NULL) != SQLITE_OK)
+	{
+		tmplog ("%s while preparing: \"%s\"\n", sqlite3_errmsg (db), sql);
+		stmt = NULL;
+	} else {
+		g_hash_table_replace (cache, strdup (attr), stmt);
+	}
+	free (sql);
+	return stmt;
+}
+
+static void free_stmts (GHashTable *cache)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, cache);
+	while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+		sqlite3_finalize (value);
+		free (key);
 	}
+	g_hash_table_destroy (cache);
+}
+
+static void put_value (unsigned char *key, struct dirty_attr *d)
+{
+	sqlite3_stmt *stmt = cached_stmt (writedb, put_stmts, d->attr,
+					  "UPDATE Files SET %s=?1 WHERE sha1=?2;");
+	if (! stmt)
+		return;
+
+	if (d->is_double)
+		sqlite3_bind_double (stmt, 1, d->dval);
+	else
+		sqlite3_bind_int (stmt, 1, d->ival);
+	sqlite3_bind_blob (stmt, 2, key, KEY_SIZE, SQLITE_STATIC);
+
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		tmplog ("%s while updating %s\n", sqlite3_errmsg (writedb), d->attr);
+	sqlite3_reset (stmt);
+}
+
+static bool write_exec (char *sql)
+{
+	char *err = NULL;
 
-	entrydb = handle;
+	sqlite3_exec (writedb, sql, NULL, NULL, &err);
+	if (err)
+	{
+		tmplog ("%s while executing: \"%s\"\n", err, sql);
+		sqlite3_free (err);
+		return false;
+	}
 	return true;
 }
 
-void close_entrydb (void)
+static void insert_rows (GPtrArray *inserts)
 {
-	sqlite3_close (entrydb);
-	entrydb = NULL;
+	int i;
+
+	if (! insert_stmt &&
+	    sqlite3_prepare_v2 (writedb, "INSERT OR IGNORE INTO Files (sha1) VALUES (?1);",
+				-1, &insert_stmt, NULL) != SQLITE_OK)
+	{
+		tmplog ("%s while preparing insert\n", sqlite3_errmsg (writedb));
+		return;
+	}
+
+	for (i = 0; i < inserts->len; i++)
+	{
+		struct file_row *row = g_ptr_array_index (inserts, i);
+		sqlite3_bind_blob (insert_stmt, 1, row->key, KEY_SIZE, SQLITE_STATIC);
+		if (sqlite3_step (insert_stmt) != SQLITE_DONE)
+			tmplog ("%s while inserting a row\n", sqlite3_errmsg (writedb));
+		sqlite3_reset (insert_stmt);
+	}
 }
 
-static char *database_get (sqlite3 *db, char *sha, char *key)
+/* Write JOBS in one transaction. Return false if nothing was written. */
+static bool write_jobs (struct write_job *jobs)
 {
-	char *val = NULL;
+	struct write_job *job;
+	bool checkpoint = false;
 
-	int get_callback (void *data, int ncols, char **values, char **names)
+	/* Take the write lock now, rather than fail at the first write. */
+	if (! write_exec ("BEGIN IMMEDIATE;"))
+		return false;
+
+	for (job = jobs; job; job = job->next)
 	{
-		if (ncols >= 1 && !val)	/* Exactly 1! */
-			val = strdup (values[0]);
+		if (job->inserts)
+			insert_rows (job->inserts);
+		if (job->attrs)
+		{
+			GHashTableIter iter;
+			gpointer key, value;
+
+			g_hash_table_iter_init (&iter, job->attrs);
+			while (g_hash_table_iter_next (&iter, &key, &value))
+			{
+				struct dirty_attr *d = value;
+				put_value (d->key, d);
+			}
+		}
+		if (job->sql)
+			write_exec (job->sql);
+		checkpoint |= job->checkpoint;
+	}
+
+	if (! write_exec ("COMMIT;"))
+	{
+		write_exec ("ROLLBACK;");
+		return false;
+	}
+
+	/* Sync the WAL into the database file. */
+	if (checkpoint)
+		sqlite3_wal_checkpoint_v2 (writedb, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+	return true;
+}
+
+static void free_jobs (struct write_job *jobs)
+{
+	while (jobs)
+	{
+		struct write_job *next = jobs->next;
+		if (jobs->inserts)
+			g_ptr_array_free (jobs->inserts, TRUE);
+		if (jobs->attrs)
+			g_hash_table_destroy (jobs->attrs);
+		free (jobs->sql);
+		free (jobs);
+		jobs = next;
+	}
+}
+
+static void *writer_thread (void *unused)
+{
+	struct write_job *job;
+	int failures = 0;
+	bool written;
+
+	pthread_mutex_lock (&writer_lock);
+	for (;;)
+	{
+		while (! queue_head && ! writer_quit)
+			pthread_cond_wait (&writer_cond, &writer_lock);
+		if (! queue_head)
+			break;
+
+		/* Everything queued so far goes into one transaction. */
+		writing = queue_head;
+		queue_head = queue_tail = NULL;
+		pthread_mutex_unlock (&writer_lock);
+
+		written = write_jobs (writing);
+		if (! written && ! (writer_quit && ++failures >= WRITE_RETRIES))
+		{
+			/* Put the jobs back in front of the ones queued meanwhile. */
+			pthread_mutex_lock (&writer_lock);
+			for (job = writing; job->next; job = job->next)
+				;
+			job->next = queue_head;
+			if (! queue_head)
+				queue_tail = job;
+			queue_head = writing;
+			writing = NULL;
+			pthread_mutex_unlock (&writer_lock);
+
+			sleep (WRITE_RETRY_DELAY);
+			pthread_mutex_lock (&writer_lock);
+			continue;
+		}
+		if (! written)
+			tmplog ("Lost a batch of database writes\n");
+		failures = 0;
+
+		pthread_mutex_lock (&writer_lock);
+		for (job = writing; job; job = job->next)
+			committed = job->serial;
+		free_jobs (writing);
+		writing = NULL;
+		pthread_cond_broadcast (&written_cond);
+	}
+	pthread_mutex_unlock (&writer_lock);
+
+	free_stmts (put_stmts);
+	put_stmts = NULL;
+	sqlite3_finalize (insert_stmt);
+	insert_stmt = NULL;
+	return NULL;
+}
+
+/* Queue JOB for the writer and return its serial. */
+static unsigned int submit (struct write_job *job)
+{
+	unsigned int serial;
+
+	pthread_mutex_lock (&writer_lock);
+	serial = job->serial = ++submitted;
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal (&writer_cond);
+	pthread_mutex_unlock (&writer_lock);
+	return serial;
+}
+
+/* The serial that the job taking the writes collected now will get. */
+static unsigned int next_serial (void)
+{
+	unsigned int serial;
+
+	pthread_mutex_lock (&writer_lock);
+	serial = submitted + 1;
+	pthread_mutex_unlock (&writer_lock);
+	return serial;
+}
+
+static struct write_job *new_job (void)
+{
+	struct write_job *job = calloc (1, sizeof (*job));
+	if (! job)
+		abort ();
+	return job;
+}
+
+/*
+ * Let the writer execute SQL after the writes collected so far.
+ * Return the serial of the job, or 0 if there is no writer.
+ */
+static unsigned int write_sql (char *fmt, ...)
+{
+	struct write_job *job;
+	va_list list;
+
+	if (! writedb)
 		return 0;
+
+	/* The SQL may refer to new rows or update dirty attributes. */
+	submit_pending ();
+
+	job = new_job ();
+	va_start (list, fmt);
+	vasprintf (&job->sql, fmt, list);
+	va_end (list);
+	return submit (job);
+}
+
+static bool have_pending (void)
+{
+	return (dirty && g_hash_table_size (dirty)) || (new_rows && new_rows->len);
+}
+
+/* Give the new rows and the dirty attributes to the writer. */
+static void submit_pending (void)
+{
+	struct write_job *job;
+
+	if (! have_pending ())
+		return;
+
+	job = new_job ();
+	if (new_rows && new_rows->len)
+	{
+		job->inserts = new_rows;
+		new_rows = NULL;
+	}
+	if (dirty && g_hash_table_size (dirty))
+	{
+		job->attrs = dirty;
+		dirty = NULL;
 	}
+	submit (job);
+}
 
-	if (! entrydb_exec (get_callback, "SELECT %s FROM Files WHERE sha1=\"%s\" limit 1;", key, sha))
-		return NULL;
-	return val;
+/* Wait until the writer has committed everything given to it. */
+static void wait_for_writer (void)
+{
+	pthread_mutex_lock (&writer_lock);
+	while (queue_head || writing)
+		pthread_cond_wait (&written_cond, &writer_lock);
+	pthread_mutex_unlock (&writer_lock);
 }
 
-void entrydb_ensure_exists (char *sha1)
+static bool start_writer (char *filename)
 {
-	char *val = database_get (entrydb, sha1, "sha1");
-	if (! val)
+	if (filename != writer_filename)
+	{
+		free (writer_filename);
+		writer_filename = strdup (filename);
+	}
+	if (sqlite3_open (filename, &writedb) != SQLITE_OK)
+	{
+		tmplog ("%s: %s\n", filename, sqlite3_errmsg (writedb));
+		sqlite3_close (writedb);
+		writedb = NULL;
+		return false;
+	}
+
+	/* Other programs, like the python tools, may write too. */
+	sqlite3_busy_timeout (writedb, 5000);
+	write_exec ("PRAGMA synchronous=NORMAL;");
+
+	put_stmts = g_hash_table_new (g_str_hash, g_str_equal);
+	writer_quit = false;
+	if (pthread_create (&writer, NULL, writer_thread, NULL))
 	{
-		entrydb_exec (NULL, "INSERT INTO Files (sha1) VALUES (\"%s\");", sha1);
+		free_stmts (put_stmts);
+		put_stmts = NULL;
+		sqlite3_close (writedb);
+		writedb = NULL;
+		return false;
 	}
-	free (val);
+	return true;
 }
 
-char *entrydb_get (struct atrfs_entry *ent, char *attr)
+static void stop_writer (void)
 {
-	char *val = NULL;
-	if (entrydb)
+	if (! writedb)
+		return;
+
+	pthread_mutex_lock (&writer_lock);
+	writer_quit = true;
+	pthread_cond_signal (&writer_cond);
+	pthread_mutex_unlock (&writer_lock);
+	pthread_join (writer, NULL);
+
+	sqlite3_close (writedb);
+	writedb = NULL;
+}
+
+/*
+ * Remember that the row of KEY changes in the job SERIAL: until that
+ * is committed, queries see the row through Pending.
+ */
+static struct override *note_override (unsigned char *key, unsigned int serial)
+{
+	struct override *o;
+
+	if (! overrides)
+		return NULL;
+
+	o = g_hash_table_lookup (overrides, key);
+	if (! o)
 	{
-		char *sha1 = get_sha1_fast (REAL_NAME (ent));
-		if (! sha1)
+		o = calloc (1, sizeof (*o));
+		if (! o)
 			abort ();
-
-		val = database_get (entrydb, sha1, attr);
+		memcpy (o->key, key, KEY_SIZE);
+		memcpy (o->src, key, KEY_SIZE);
+		g_hash_table_insert (overrides, o->key, o);
 	}
+	o->gone = false;
+	o->serial = serial;
+	overrides_stale = true;
+	return o;
+}
 
-	return val;
+/* Run SQL, a statement on the temporary tables, on KEY1 and KEY2. */
+static void pending_exec (char *sql, unsigned char *key1, unsigned char *key2)
+{
+	sqlite3_stmt *stmt = cached_stmt (entrydb, pending_stmts, sql, "%s");
+
+	if (! stmt)
+		return;
+
+	sqlite3_bind_blob (stmt, 1, key1, KEY_SIZE, SQLITE_STATIC);
+	if (key2)
+		sqlite3_bind_blob (stmt, 2, key2, KEY_SIZE, SQLITE_STATIC);
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		tmplog ("%s while executing: \"%s\"\n", sqlite3_errmsg (entrydb), sql);
+	sqlite3_reset (stmt);
+}
+
+/* Store the value in D into the Pending row of KEY. */
+static void pending_put (unsigned char *key, struct dirty_attr *d)
+{
+	sqlite3_stmt *stmt = cached_stmt (entrydb, pending_stmts, d->attr,
+					  "UPDATE temp.Pending SET %s=?2 WHERE sha1=?1;");
+	if (! stmt)
+		return;
+
+	sqlite3_bind_blob (stmt, 1, key, KEY_SIZE, SQLITE_STATIC);
+	if (d->is_double)
+		sqlite3_bind_double (stmt, 2, d->dval);
+	else
+		sqlite3_bind_int (stmt, 2, d->ival);
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		tmplog ("%s while updating Pending.%s\n", sqlite3_errmsg (entrydb), d->attr);
+	sqlite3_reset (stmt);
 }
 
-void entrydb_put (struct atrfs_entry *ent, char *attr, char *val)
+/*
+ * Bring Hidden and Pending up to date. Overrides committed by the
+ * writer are dropped; the rows of the others are made from their
+ * committed rows, the attributes in the jobs and in the dirty table,
+ * oldest first, and at last the values of the in-memory rows.
+ */
+static void refresh_pending (void)
 {
-	if (entrydb)
+	GHashTableIter iter;
+	struct override *o;
+	struct write_job *job;
+	unsigned int done;
+
+	void put_attrs (GHashTable *attrs)
+	{
+		GHashTableIter it;
+		struct dirty_attr *d;
+
+		g_hash_table_iter_init (&it, attrs);
+		while (g_hash_table_iter_next (&it, NULL, (gpointer *)&d))
+		{
+			struct override *over = g_hash_table_lookup (overrides, d->key);
+			if (over && ! over->gone)
+				pending_put (d->key, d);
+		}
+	}
+
+	void put_row (struct file_row *row)
 	{
-		char *sha1 = get_sha1 (REAL_NAME(ent));
+		struct dirty_attr d = { .attr = "count", .ival = row->count };
+		pending_put (row->key, &d);
+		d = (struct dirty_attr){ .attr = "watchtime", .is_double = true, .dval = row->watchtime };
+		pending_put (row->key, &d);
+		d = (struct dirty_attr){ .attr = "length", .is_double = true, .dval = row->length };
+		pending_put (row->key, &d);
+	}
+
+	pthread_mutex_lock (&writer_lock);
+	done = committed;
+	pthread_mutex_unlock (&writer_lock);
+	if (! overrides || (! overrides_stale && done == refreshed))
+		return;
+
+	entrydb_exec (NULL, "BEGIN; DELETE FROM temp.Hidden; DELETE FROM temp.Pending;");
+	g_hash_table_iter_init (&iter, overrides);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&o))
+	{
+		if (o->serial <= done)
+		{
+			g_hash_table_iter_remove (&iter);
+			continue;
+		}
+		if (o->moved && o->moved <= done)
+		{
+			memcpy (o->src, o->key, KEY_SIZE);
+			o->moved = 0;
+		}
 
-		entrydb_exec (NULL, "UPDATE Files SET %s = \"%s\" WHERE sha1=\"%s\";", attr, val, sha1);
+		pending_exec ("INSERT INTO temp.Hidden VALUES (?1);", o->key, NULL);
+		if (o->gone)
+			continue;
+
+		pending_exec ("INSERT INTO temp.Pending SELECT * FROM main.Files WHERE sha1=?1;",
+			      o->src, NULL);
+		if (sqlite3_changes (entrydb) == 0)
+			pending_exec ("INSERT INTO temp.Pending (sha1) VALUES (?1);", o->src, NULL);
+		if (memcmp (o->src, o->key, KEY_SIZE))
+			pending_exec ("UPDATE temp.Pending SET sha1=?2 WHERE sha1=?1;", o->src, o->key);
+		if (o->has_fingerprint)
+			pending_exec ("UPDATE temp.Pending SET fingerprint=?2 WHERE sha1=?1;",
+				      o->key, o->fingerprint);
+	}
+
+	pthread_mutex_lock (&writer_lock);
+	for (job = writing; job; job = job->next)
+		if (job->attrs)
+			put_attrs (job->attrs);
+	for (job = queue_head; job; job = job->next)
+		if (job->attrs)
+			put_attrs (job->attrs);
+	pthread_mutex_unlock (&writer_lock);
+	if (dirty)
+		put_attrs (dirty);
+
+	/* A rekeyed row has the counters of both keys only in memory. */
+	g_hash_table_iter_init (&iter, overrides);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&o))
+	{
+		struct file_row *row = o->gone ? NULL : find_row (o->key, false);
+		if (row)
+			put_row (row);
 	}
+	entrydb_exec (NULL, "COMMIT;");
+
+	overrides_stale = false;
+	refreshed = done;
+}
+
+static bool create_pending_view (void)
+{
+	overrides = g_hash_table_new_full (key_hash, key_equal, NULL, free);
+	pending_stmts = g_hash_table_new (g_str_hash, g_str_equal);
+	return entrydb_exec (NULL,
+			     "PRAGMA temp_store=MEMORY;"
+			     "CREATE TEMP TABLE Hidden (sha1 BLOB PRIMARY KEY) WITHOUT ROWID;"
+			     "CREATE TEMP TABLE Pending AS SELECT * FROM main.Files WHERE 0;"
+			     "CREATE UNIQUE INDEX temp.Pending_sha1 ON Pending (sha1);"
+			     "CREATE TEMP VIEW Files AS SELECT * FROM main.Files"
+			     " WHERE sha1 NOT IN (SELECT sha1 FROM temp.Hidden)"
+			     " UNION ALL SELECT * FROM temp.Pending;");
+}
+
+bool open_entrydb (char *filename)
+{
+	sqlite3 *handle = NULL;
+	bool must_create = false;
+
+	if (access (filename, F_OK) != 0)
+		must_create = true;
+
+	sqlite3_open (filename, &handle);
+	sqlite3_create_function (handle, "atrfs_unhex", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				 NULL, sql_unhex, NULL, NULL);
+
+	entrydb = handle; /* Hack! */
+	if (must_create)
+	{
+		if (! entrydb_exec (NULL, FILES_SCHEMA "PRAGMA user_version = 1;"))
+			goto err;
+		tmplog ("Created database: %s\n", filename);
+	}
+
+	if (! upgrade_schema (filename))
+		goto err;
+
+	/* WAL mode is persistent, so this is a no-op after the first time. */
+	if (! entrydb_exec (NULL, "PRAGMA journal_mode=WAL;") || ! start_writer (filename))
+		goto err;
+
+	get_stmts = g_hash_table_new (g_str_hash, g_str_equal);
+	key_stmts = g_hash_table_new (g_str_hash, g_str_equal);
+	if (! load_rows () || ! create_pending_view ())
+	{
+		close_entrydb ();
+		return false;
+	}
+	return true;
+err:
+	sqlite3_close (handle);
+	entrydb = NULL;
+	return false;
+}
+
+void close_entrydb (void)
+{
+	if (! entrydb)
+		return;
+
+	entrydb_flush ();
+	stop_writer ();
+
+	if (dirty)
+	{
+		g_hash_table_destroy (dirty);
+		dirty = NULL;
+	}
+
+	free_stmts (get_stmts);
+	free_stmts (key_stmts);
+	get_stmts = NULL;
+	key_stmts = NULL;
+	if (overrides)
+	{
+		free_stmts (pending_stmts);
+		g_hash_table_destroy (overrides);
+		pending_stmts = NULL;
+		overrides = NULL;
+	}
+	free_rows ();
+
+	/* The last connection to close checkpoints and removes the WAL. */
+	sqlite3_close (entrydb);
+	entrydb = NULL;
+}
+
+/*
+ * fuse_daemonize() forks, and only the forking thread lives on in
+ * the child. The writer is stopped around it and started again.
+ */
+void entrydb_suspend (void)
+{
+	if (! entrydb)
+		return;
+	entrydb_flush ();
+	stop_writer ();
+}
+
+void entrydb_resume (void)
+{
+	if (entrydb && ! writedb && ! start_writer (writer_filename))
+		tmplog ("entrydb_resume: can't start the writer\n");
+}
+
+void entrydb_ensure_exists (unsigned char *sha1)
+{
+	find_row (sha1, true);
+}
+
+/* Step STMT and call FN for each row, see entrydb_foreach_key. */
+static int foreach_row (sqlite3_stmt *stmt, void (*fn)(char *text, unsigned char *key))
+{
+	int rc;
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+	{
+		int n = sqlite3_column_count (stmt);
+		const void *key = sqlite3_column_blob (stmt, n - 1);
+
+		if (key && sqlite3_column_bytes (stmt, n - 1) == KEY_SIZE)
+			fn (n > 1 ? (char *)sqlite3_column_text (stmt, 0) : NULL,
+			    (unsigned char *)key);
+	}
+	return rc;
+}
+
+static bool foreach_key (char *sql, void (*fn)(char *text, unsigned char *key))
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2 (entrydb, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		tmplog ("%s while executing: \"%s\"\n", sqlite3_errmsg (entrydb), sql);
+		return false;
+	}
+
+	rc = foreach_row (stmt, fn);
+	sqlite3_finalize (stmt);
+	return rc == SQLITE_DONE;
+}
+
+/*
+ * Run SQL and call FN for each row. The last column of a row
+ * must be a key. The first one is passed as TEXT when there are
+ * two columns (like in "select 'new', sha1 from Files"). The query
+ * sees the writes not committed yet through the Files view. FN must
+ * not call the other entrydb functions.
+ */
+bool entrydb_foreach_key (char *sql, void (*fn)(char *text, unsigned char *key))
+{
+	bool ret;
+
+	if (! entrydb)
+		return false;
+
+	pthread_mutex_lock (&reader_lock);
+	refresh_pending ();
+	ret = foreach_key (sql, fn);
+	pthread_mutex_unlock (&reader_lock);
+	return ret;
+}
+
+/*
+ * Like entrydb_foreach_key, but only for the rows whose key is KEY.
+ * SQL is run as a subquery limited by the key, so that SQLite can look
+ * the row up instead of going through the whole table. This needs the
+ * key column to be named sha1; other queries are run as they are.
+ */
+bool entrydb_foreach_key_of (char *sql, unsigned char *key,
+			     void (*fn)(char *text, unsigned char *key))
+{
+	sqlite3_stmt *stmt;
+	bool ret;
+
+	void match (char *text, unsigned char *k)
+	{
+		if (memcmp (k, key, KEY_SIZE) == 0)
+			fn (text, k);
+	}
+
+	if (! entrydb)
+		return false;
+
+	pthread_mutex_lock (&reader_lock);
+	refresh_pending ();
+	if (! g_hash_table_lookup_extended (key_stmts, sql, NULL, (gpointer *)&stmt))
+	{
+		int len = strlen (sql);
+		char *wrapped = NULL;
+
+		while (len > 0 && strchr (" \t\n;", sql[len - 1]))
+			len--;
+		asprintf (&wrapped, "SELECT * FROM (%.*s) WHERE sha1=?1;", len, sql);
+		if (sqlite3_prepare_v3 (entrydb, wrapped, -1, SQLITE_PREPARE_PERSISTENT,
+					&stmt, NULL) != SQLITE_OK)
+		{
+			tmplog ("Can't limit \"%s\" to one file: %s\n", sql, sqlite3_errmsg (entrydb));
+			stmt = NULL;
+		}
+		free (wrapped);
+
+		/* A NULL statement remembers that SQL can't be limited. */
+		g_hash_table_insert (key_stmts, strdup (sql), stmt);
+	}
+	if (stmt)
+	{
+		sqlite3_bind_blob (stmt, 1, key, KEY_SIZE, SQLITE_STATIC);
+		ret = foreach_row (stmt, fn) == SQLITE_DONE;
+		sqlite3_reset (stmt);
+	} else {
+		ret = foreach_key (sql, match);
+	}
+	pthread_mutex_unlock (&reader_lock);
+	return ret;
+}
+
+/*
+ * Return the number of rows having the given FINGERPRINT and
+ * store the key of the first one into SHA1.
+ */
+int entrydb_find_fingerprint (unsigned char *fingerprint, unsigned char *sha1)
+{
+	char hex[2 * KEY_SIZE + 1];
+	char *sql = NULL;
+	int rows = 0;
+
+	void find_callback (char *text, unsigned char *key)
+	{
+		if (rows++ == 0)
+			memcpy (sha1, key, KEY_SIZE);
+	}
+
+	asprintf (&sql, "SELECT sha1 FROM Files WHERE fingerprint=x'%s';",
+		  key_to_hex (fingerprint, hex));
+	entrydb_foreach_key (sql, find_callback);
+	free (sql);
+	return rows;
+}
+
+void entrydb_set_fingerprint (unsigned char *sha1, unsigned char *fingerprint)
+{
+	char hex1[2 * KEY_SIZE + 1], hex2[2 * KEY_SIZE + 1];
+	unsigned int serial;
+	struct override *o;
+
+	serial = write_sql ("UPDATE Files SET fingerprint=x'%s' WHERE sha1=x'%s';",
+			    key_to_hex (fingerprint, hex1), key_to_hex (sha1, hex2));
+	o = note_override (sha1, serial);
+	if (o)
+	{
+		memcpy (o->fingerprint, fingerprint, KEY_SIZE);
+		o->has_fingerprint = true;
+	}
+}
+
+/*
+ * Move the row of OLD to the key NEW. If NEW already has
+ * a row, the counters of OLD are added to it.
+ */
+void entrydb_rekey (unsigned char *old, unsigned char *new)
+{
+	char o[2 * KEY_SIZE + 1], n[2 * KEY_SIZE + 1];
+	struct file_row *orow = find_row (old, false);
+	struct file_row *nrow = find_row (new, false);
+	bool moved = orow && ! nrow;
+	unsigned int serial;
+
+	/* Rows of old keys stay allocated: entries may still point to them. */
+	if (orow)
+	{
+		if (nrow)
+		{
+			nrow->count += orow->count;
+			nrow->watchtime += orow->watchtime;
+		} else {
+			nrow = malloc (sizeof (*nrow));
+			if (! nrow)
+				abort ();
+			*nrow = *orow;
+			memcpy (nrow->key, new, KEY_SIZE);
+			g_hash_table_insert (rows, nrow->key, nrow);
+			g_ptr_array_add (created_rows, nrow);
+		}
+		g_hash_table_remove (rows, old);
+	}
+
+	key_to_hex (old, o);
+	key_to_hex (new, n);
+	serial = write_sql ("UPDATE Files SET"
+			    " count = count + ifnull((SELECT count FROM Files WHERE sha1=x'%s'), 0),"
+			    " watchtime = watchtime + ifnull((SELECT watchtime FROM Files WHERE sha1=x'%s'), 0)"
+			    " WHERE sha1=x'%s';"
+			    "UPDATE OR IGNORE Files SET sha1=x'%s' WHERE sha1=x'%s';"
+			    "DELETE FROM Files WHERE sha1=x'%s';",
+			    o, o, n, n, o, o);
+
+	/* Until that is committed, queries see the moved row of OLD under NEW. */
+	if (orow && overrides)
+	{
+		struct override *from = note_override (old, serial);
+		struct override *to = note_override (new, serial);
+
+		if (moved)
+		{
+			memcpy (to->src, from->src, KEY_SIZE);
+			memcpy (to->fingerprint, from->fingerprint, KEY_SIZE);
+			to->has_fingerprint = from->has_fingerprint;
+			to->moved = serial;
+		}
+		from->gone = true;
+	}
+}
+
+static guint dirty_hash (gconstpointer p)
+{
+	const struct dirty_attr *d = p;
+	guint h;
+
+	memcpy (&h, d->key, sizeof (h));
+	return h ^ g_direct_hash (d->attr);
+}
+
+static gboolean dirty_equal (gconstpointer a, gconstpointer b)
+{
+	const struct dirty_attr *d1 = a, *d2 = b;
+	return d1->attr == d2->attr && memcmp (d1->key, d2->key, KEY_SIZE) == 0;
+}
+
+/* Return the statement reading ATTR. */
+static sqlite3_stmt *get_stmt (char *attr)
+{
+	return cached_stmt (entrydb, get_stmts, attr, "SELECT %s FROM main.Files WHERE sha1=?1;");
+}
+
+/*
+ * Return the copy of the name ATTR that is kept in get_stmts,
+ * so that attribute names can be compared as pointers.
+ */
+static char *intern_attr (char *attr)
+{
+	gpointer name, value;
+
+	if (get_stmt (attr) &&
+	    g_hash_table_lookup_extended (get_stmts, attr, &name, &value))
+		return name;
+	return NULL;
+}
+
+static struct dirty_attr *lookup_job (struct write_job *job, struct dirty_attr *d)
+{
+	struct dirty_attr *ret = NULL;
+
+	for (; job; job = job->next)
+	{
+		struct dirty_attr *found = job->attrs ? g_hash_table_lookup (job->attrs, d) : NULL;
+		if (found)
+			ret = found;
+	}
+	return ret;
+}
+
+/*
+ * Find a value of ATTR for KEY that is not in the database yet.
+ * The newest one is in the dirty table, then in the queue.
+ */
+static bool find_dirty (unsigned char *key, char *attr, struct dirty_attr *ret)
+{
+	struct dirty_attr d, *found = NULL;
+
+	memcpy (d.key, key, KEY_SIZE);
+	d.attr = intern_attr (attr);
+
+	if (dirty)
+		found = g_hash_table_lookup (dirty, &d);
+	if (found)
+	{
+		*ret = *found;
+		return true;
+	}
+
+	pthread_mutex_lock (&writer_lock);
+	found = lookup_job (queue_head, &d);
+	if (! found)
+		found = lookup_job (writing, &d);
+	if (found)
+		*ret = *found;
+	pthread_mutex_unlock (&writer_lock);
+	return found != NULL;
+}
+
+static void set_dirty (unsigned char *key, char *attr, bool is_double, int ival, double dval)
+{
+	struct dirty_attr d, *found;
+
+	memcpy (d.key, key, KEY_SIZE);
+	d.attr = intern_attr (attr);
+	if (! d.attr)
+		return;
+
+	if (! dirty)
+		dirty = g_hash_table_new_full (dirty_hash, dirty_equal, free, NULL);
+
+	found = g_hash_table_lookup (dirty, &d);
+	if (! found)
+	{
+		found = malloc (sizeof (*found));
+		if (! found)
+			abort ();
+		*found = d;
+		if (! have_pending ())
+			clock_gettime (CLOCK_MONOTONIC, &dirty_since);
+		g_hash_table_insert (dirty, found, found);
+	}
+
+	found->is_double = is_double;
+	found->ival = ival;
+	found->dval = dval;
+	note_override (key, next_serial ());
+
+	if (g_hash_table_size (dirty) + (new_rows ? new_rows->len : 0) >= WRITEBACK_MAX)
+		submit_pending ();
+}
+
+/*
+ * Find the value of ATTR for KEY in the database. On success the
+ * returned statement is positioned on it and the caller must
+ * sqlite3_reset() it.
+ */
+static sqlite3_stmt *key_lookup (unsigned char *key, char *attr)
+{
+	sqlite3_stmt *stmt;
+
+	if (! entrydb || ! (stmt = get_stmt (attr)))
+		return NULL;
+
+	sqlite3_bind_blob (stmt, 1, key, KEY_SIZE, SQLITE_STATIC);
+	if (sqlite3_step (stmt) == SQLITE_ROW &&
+	    sqlite3_column_type (stmt, 0) != SQLITE_NULL)
+		return stmt;
+
+	sqlite3_reset (stmt);
+	return NULL;
+}
+
+static bool key_get_int (struct file_row *row, unsigned char *key, char *attr, int *val)
+{
+	struct dirty_attr d;
+	sqlite3_stmt *stmt;
+	double *dp;
+	int *ip;
+
+	if (row_attr (row, attr, &ip, &dp))
+	{
+		*val = ip ? *ip : *dp;
+		return true;
+	}
+
+	if (find_dirty (key, attr, &d))
+	{
+		*val = d.is_double ? d.dval : d.ival;
+		return true;
+	}
+
+	stmt = key_lookup (key, attr);
+	if (! stmt)
+		return false;
+	*val = sqlite3_column_int (stmt, 0);
+	sqlite3_reset (stmt);
+	return true;
+}
+
+static bool key_get_double (struct file_row *row, unsigned char *key, char *attr, double *val)
+{
+	struct dirty_attr d;
+	sqlite3_stmt *stmt;
+	double *dp;
+	int *ip;
+
+	if (row_attr (row, attr, &ip, &dp))
+	{
+		*val = ip ? *ip : *dp;
+		return true;
+	}
+
+	if (find_dirty (key, attr, &d))
+	{
+		*val = d.is_double ? d.dval : d.ival;
+		return true;
+	}
+
+	stmt = key_lookup (key, attr);
+	if (! stmt)
+		return false;
+	*val = sqlite3_column_double (stmt, 0);
+	sqlite3_reset (stmt);
+	return true;
+}
+
+/*
+ * Commit all writes and sync them to the disk. This waits for
+ * the writer, so it is only done on fsync and on unmount.
+ */
+void entrydb_flush (void)
+{
+	struct write_job *job;
+
+	if (! writedb)
+		return;
+
+	submit_pending ();
+	job = new_job ();
+	job->checkpoint = true;
+	submit (job);
+	wait_for_writer ();
+}
+
+/*
+ * Give the pending writes to the writer if the oldest of them has
+ * waited long enough. Return the time until that in TS, or NULL when
+ * nothing is waiting.
+ */
+struct timespec *entrydb_writeback (struct timespec *ts)
+{
+	struct timespec now;
+
+	if (! have_pending ())
+		return NULL;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ts->tv_sec = dirty_since.tv_sec + WRITEBACK_DELAY - now.tv_sec;
+	ts->tv_nsec = dirty_since.tv_nsec - now.tv_nsec;
+	if (ts->tv_nsec < 0)
+	{
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+
+	if (ts->tv_sec < 0)
+	{
+		submit_pending ();
+		return NULL;
+	}
+	return ts;
+}
+
+/*
+ * Store a value of ATTR for KEY in ROW and queue it for the database.
+ * Return false if ROW already had that value.
+ */
+static bool key_put (struct file_row *row, unsigned char *key, char *attr,
+		     bool is_double, int ival, double dval)
+{
+	bool changed = true;
+	double *dp;
+	int *ip;
+
+	if (row_attr (row, attr, &ip, &dp))
+	{
+		if (ip)
+		{
+			int v = is_double ? dval : ival;
+			changed = *ip != v;
+			*ip = v;
+		} else {
+			double v = is_double ? dval : ival;
+			changed = *dp != v;
+			*dp = v;
+		}
+	}
+	set_dirty (key, attr, is_double, ival, dval);
+	return changed;
+}
+
+bool entrydb_get_int (struct atrfs_entry *ent, char *attr, int *val)
+{
+	bool ret;
+
+	if (! entrydb || ! entry_key (ent))
+		return false;
+	pthread_mutex_lock (&reader_lock);
+	ret = key_get_int (entry_row (ent), entry_key (ent), attr, val);
+	pthread_mutex_unlock (&reader_lock);
+	return ret;
+}
+
+bool entrydb_get_double (struct atrfs_entry *ent, char *attr, double *val)
+{
+	bool ret;
+
+	if (! entrydb || ! entry_key (ent))
+		return false;
+	pthread_mutex_lock (&reader_lock);
+	ret = key_get_double (entry_row (ent), entry_key (ent), attr, val);
+	pthread_mutex_unlock (&reader_lock);
+	return ret;
+}
+
+void entrydb_put_int (struct atrfs_entry *ent, char *attr, int val)
+{
+	if (entrydb && entry_key (ent)
+	    && key_put (entry_row (ent), entry_key (ent), attr, false, val, 0.0))
+		FILE_ENTRY(ent)->changed |= entrydb_column (attr);
+}
+
+void entrydb_put_double (struct atrfs_entry *ent, char *attr, double val)
+{
+	if (entrydb && entry_key (ent)
+	    && key_put (entry_row (ent), entry_key (ent), attr, true, 0, val))
+		FILE_ENTRY(ent)->changed |= entrydb_column (attr);
+}
+
+/*
+ * Store in TOP the (at most) K rows with the largest value of ATTR,
+ * largest first, or with the smallest values if SMALLEST. Rows for
+ * which WANT returns false are skipped. The rows are scanned once
+ * keeping the best K so far in a heap, so this takes O(n log k).
+ * Return the number of rows stored.
+ */
+size_t entrydb_top_rows (char *attr, size_t k, bool smallest,
+			 bool (*want)(struct file_row *row), struct file_row **top)
+{
+	GHashTableIter iter;
+	struct file_row *row;
+	size_t n = 0;
+
+	double value (struct file_row *r)
+	{
+		int *ip;
+		double *dp;
+		row_attr (r, attr, &ip, &dp);
+		return ip ? *ip : *dp;
+	}
+
+	/* Should A be listed before B? */
+	bool better (struct file_row *a, struct file_row *b)
+	{
+		return smallest ? value (a) < value (b) : value (a) > value (b);
+	}
+
+	/* The heap keeps the worst row of the best K at its top. */
+	void sift_down (size_t i, size_t len)
+	{
+		for (;;)
+		{
+			size_t c = 2 * i + 1;
+			if (c >= len)
+				break;
+			if (c + 1 < len && better (top[c], top[c + 1]))
+				c++;
+			if (! better (top[i], top[c]))
+				break;
+			struct file_row *tmp = top[i];
+			top[i] = top[c];
+			top[c] = tmp;
+			i = c;
+		}
+	}
+
+	struct file_row probe;
+	int *ip;
+	double *dp;
+	if (! rows || k == 0 || ! row_attr (&probe, attr, &ip, &dp))
+		return 0;
+
+	g_hash_table_iter_init (&iter, rows);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&row))
+	{
+		if (want && ! want (row))
+			continue;
+		if (n < k)
+		{
+			size_t i = n++;
+			top[i] = row;
+			while (i > 0 && better (top[(i - 1) / 2], top[i]))
+			{
+				struct file_row *tmp = top[i];
+				top[i] = top[(i - 1) / 2];
+				top[(i - 1) / 2] = tmp;
+				i = (i - 1) / 2;
+			}
+		} else if (better (row, top[0])) {
+			top[0] = row;
+			sift_down (0, n);
+		}
+	}
+
+	/* Sort by taking the worst from the heap to the end. */
+	size_t len;
+	for (len = n; len > 1; len--)
+	{
+		struct file_row *tmp = top[0];
+		top[0] = top[len - 1];
+		top[len - 1] = tmp;
+		sift_down (0, len - 1);
+	}
+	return n;
+}
+
+/* The COLUMN_* bit of the Files column NAME. The key column has none. */
+unsigned int entrydb_column (const char *name)
+{
+	if (strcmp (name, "sha1") == 0)
+		return 0;
+	if (strcmp (name, "count") == 0)
+		return COLUMN_COUNT;
+	if (strcmp (name, "watchtime") == 0)
+		return COLUMN_WATCHTIME;
+	if (strcmp (name, "length") == 0)
+		return COLUMN_LENGTH;
+	return COLUMN_OTHER;
+}
+
+/*
+ * Return the Files columns that SQL reads, as COLUMN_* bits. The
+ * statement is only compiled; SQLite reports every column it would
+ * read to the authorizer. If SQL does not compile, all bits are set.
+ */
+unsigned int entrydb_columns_of (char *sql)
+{
+	unsigned int columns = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	int authorize (void *data, int action, const char *table,
+		       const char *column, const char *db, const char *trigger)
+	{
+		/* Reads inside the Files view have its name in TRIGGER. */
+		if (action == SQLITE_READ && table && column && ! trigger
+		    && strcasecmp (table, "Files") == 0)
+			columns |= entrydb_column (column);
+		return SQLITE_OK;
+	}
+
+	if (! entrydb)
+		return COLUMN_ALL;
+
+	sqlite3_set_authorizer (entrydb, authorize, NULL);
+	if (sqlite3_prepare_v2 (entrydb, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		tmplog ("entrydb_columns_of: %s\n", sqlite3_errmsg (entrydb));
+		columns = COLUMN_ALL;
+	}
+	sqlite3_set_authorizer (entrydb, NULL, NULL);
+	sqlite3_finalize (stmt);
+	return columns;
+}
+
+#ifdef ENTRYDB_BENCH
+#include <time.h>
+
+/* The benchmark is linked without util.c, entry.c and idcache.c. */
+void tmplog (char *fmt, ...)
+{
+	va_list list;
+	va_start (list, fmt);
+	vfprintf (stderr, fmt, list);
+	va_end (list);
+}
+
+unsigned char *get_sha1_fast_r (char *filename, unsigned char *key)
+{
+	return get_sha1_r (filename, key);
+}
+
+guint key_hash (gconstpointer key)
+{
+	guint h;
+	memcpy (&h, key, sizeof (h));
+	return h;
+}
+
+gboolean key_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, KEY_SIZE) == 0;
+}
+
+/* This is how attributes were read before the prepared statements. */
+static char *database_get (sqlite3 *db, unsigned char *sha, char *key)
+{
+	char *val = NULL;
+	char hex[2 * KEY_SIZE + 1];
+
+	int get_callback (void *data, int ncols, char **values, char **names)
+	{
+		if (ncols >= 1 && !val)	/* Exactly 1! */
+			val = strdup (values[0] ? values[0] : "");
+		return 0;
+	}
+
+	if (! entrydb_exec (get_callback, "SELECT %s FROM Files WHERE sha1=x'%s' limit 1;",
+			    key, key_to_hex (sha, hex)))
+		return NULL;
+	return val;
+}
+
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key (int i, unsigned char *key)
+{
+	memset (key, 0, KEY_SIZE);
+	memcpy (key, &i, sizeof (i));
+}
+
+static void report (char *what, int rows, double t_exec, double t_stmt)
+{
+	printf ("%-8s sqlite3_exec %8.2f us/row, entrydb %8.2f us/row (%.1fx)\n",
+		what, t_exec * 1e6 / rows, t_stmt * 1e6 / rows, t_exec / t_stmt);
+}
+
+static size_t all_rows (struct file_row **all)
+{
+	GHashTableIter iter;
+	struct file_row *row;
+	size_t n = 0;
+
+	g_hash_table_iter_init (&iter, rows);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&row))
+		all[n++] = row;
+	return n;
+}
+
+/*
+ * Run SQL to completion and check from the statement counters that
+ * it took at most MAX_STEPS full scan steps and didn't sort.
+ */
+static bool uses_index (char *sql, int max_steps)
+{
+	sqlite3_stmt *stmt;
+	int scans, sorts;
+
+	if (sqlite3_prepare_v2 (entrydb, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		printf ("%s: %s\n", sql, sqlite3_errmsg (entrydb));
+		return false;
+	}
+	while (sqlite3_step (stmt) == SQLITE_ROW)
+		;
+	scans = sqlite3_stmt_status (stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+	sorts = sqlite3_stmt_status (stmt, SQLITE_STMTSTATUS_SORT, 0);
+	sqlite3_finalize (stmt);
+
+	printf ("%-60.60s scan steps %d, sorts %d\n", sql, scans, sorts);
+	return scans <= max_steps && sorts == 0;
+}
+
+/*
+ * Compare the old sqlite3_exec() path with the prepared statements
+ * and the writer thread by reading and writing "count" and
+ * "watchtime" of every row.
+ */
+int main (int argc, char *argv[])
+{
+	char *filename = argc > 1 ? argv[1] : "entrydb-bench.db";
+	int rows = argc > 2 ? atoi (argv[2]) : 10000;
+	unsigned char key[KEY_SIZE];
+	char hex[2 * KEY_SIZE + 1];
+	double start, t_exec, t_stmt;
+	long sum_exec = 0, sum_stmt = 0;
+	char *sql = NULL;
+	bool ok = true;
+	int i;
+
+	unlink (filename);
+	if (! open_entrydb (filename))
+		return 1;
+
+	for (i = 0; i < rows; i++)
+	{
+		make_key (i, key);
+		entrydb_ensure_exists (key);
+	}
+	entrydb_flush ();
+
+	/* Writes, each in its own transaction or all through the writer */
+	start = now ();
+	for (i = 0; i < rows; i++)
+	{
+		make_key (i, key);
+		entrydb_exec (NULL, "UPDATE main.Files SET count = \"%d\" WHERE sha1=x'%s';",
+			      i, key_to_hex (key, hex));
+	}
+	t_exec = now () - start;
+
+	start = now ();
+	for (i = 0; i < rows; i++)
+	{
+		make_key (i, key);
+		key_put (find_row (key, false), key, "count", false, i + 1, 0.0);
+	}
+	entrydb_flush ();
+	t_stmt = now () - start;
+	report ("write", rows, t_exec, t_stmt);
+
+	/* Reads, two per row like file_stat() does */
+	start = now ();
+	for (i = 0; i < rows; i++)
+	{
+		int count;
+		char *val;
+
+		make_key (i, key);
+		val = database_get (entrydb, key, "count");
+		if (val && sscanf (val, "%d", &count) == 1)
+			sum_exec += count;
+		free (val);
+		free (database_get (entrydb, key, "watchtime"));
+	}
+	t_exec = now () - start;
+
+	start = now ();
+	for (i = 0; i < rows; i++)
+	{
+		int count;
+		double watchtime;
+
+		make_key (i, key);
+		if (key_get_int (find_row (key, false), key, "count", &count))
+			sum_stmt += count;
+		key_get_double (find_row (key, false), key, "watchtime", &watchtime);
+	}
+	t_stmt = now () - start;
+	report ("2 reads", rows, t_exec, t_stmt);
+
+	/* Queries see the writes that the writer has not committed. */
+	{
+		unsigned char moved[KEY_SIZE];
+		int found = 0, found_moved = 0;
+
+		void count_row (char *text, unsigned char *k)
+		{
+			found++;
+		}
+
+		void find_moved (char *text, unsigned char *k)
+		{
+			found_moved += memcmp (k, moved, KEY_SIZE) == 0;
+		}
+
+		make_key (0, key);
+		key_put (find_row (key, false), key, "count", false, -1, 0.0);
+		make_key (rows, key);
+		entrydb_ensure_exists (key);
+		make_key (1, key);
+		make_key (rows + 1, moved);
+		entrydb_rekey (key, moved);
+
+		start = now ();
+		entrydb_foreach_key ("SELECT sha1 FROM Files WHERE count <= 0;", count_row);
+		entrydb_foreach_key ("SELECT sha1 FROM Files WHERE count = 2;", find_moved);
+		printf ("queries before the commit: %.2f ms\n", (now () - start) * 1e3);
+		ok = found == 2 && found_moved == 1 && ok;
+	}
+
+	/* Another program holds the database past the busy timeout: the write waits. */
+	{
+		sqlite3 *other = NULL;
+		pthread_t holder;
+
+		void *release (void *unused)
+		{
+			sleep (7);
+			sqlite3_exec (other, "ROLLBACK;", NULL, NULL, NULL);
+			return NULL;
+		}
+
+		sqlite3_open (filename, &other);
+		sqlite3_exec (other, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+		pthread_create (&holder, NULL, release, NULL);
+
+		make_key (2, key);
+		key_put (find_row (key, false), key, "count", false, 12345, 0.0);
+		start = now ();
+		entrydb_flush ();
+		printf ("write behind another writer: %.1f s\n", now () - start);
+
+		pthread_join (holder, NULL);
+		sqlite3_close (other);
+	}
+
+	/* Startup: a query per file, or loading the whole table */
+	close_entrydb ();
+	start = now ();
+	open_entrydb (filename);
+	t_stmt = now () - start;
+
+	{
+		int count = 0;
+
+		make_key (2, key);
+		key_get_int (find_row (key, false), key, "count", &count);
+		ok = count == 12345 && ok;
+	}
+
+	start = now ();
+	for (i = 0; i < rows; i++)
+	{
+		make_key (i, key);
+		free (database_get (entrydb, key, "count"));
+	}
+	t_exec = now () - start;
+	report ("startup", rows, t_exec, t_stmt);
+
+	/* Top list: sorting every row, or keeping the best ones in a heap */
+	{
+		int k = 20;
+		struct file_row *all[rows], *top[k];
+		size_t n, ntop;
+
+		int by_count (const void *a, const void *b)
+		{
+			return (*(struct file_row **)b)->count - (*(struct file_row **)a)->count;
+		}
+
+		start = now ();
+		n = all_rows (all);
+		qsort (all, n, sizeof (all[0]), by_count);
+		t_exec = now () - start;
+
+		start = now ();
+		ntop = entrydb_top_rows ("count", k, false, NULL, top);
+		t_stmt = now () - start;
+		printf ("top %-4d qsort        %8.2f us/row, heap    %8.2f us/row (%.1fx)\n",
+			k, t_exec * 1e6 / rows, t_stmt * 1e6 / rows, t_exec / t_stmt);
+
+		for (i = 0; i < ntop; i++)
+			ok = top[i]->count == all[i]->count && ok;
+		ok = ntop == (rows < k ? rows : k) && ok;
+	}
+
+	/* The listing walks the watchtime index in order instead of sorting. */
+	make_key (rows / 2, key);
+	key_to_hex (key, hex);
+	asprintf (&sql, "SELECT count FROM Files WHERE sha1=x'%s';", hex);
+	ok = uses_index (sql, 0) && ok;
+	free (sql);
+	asprintf (&sql, "INSERT OR IGNORE INTO main.Files (sha1) VALUES (x'%s');", hex);
+	ok = uses_index (sql, 0) && ok;
+	free (sql);
+	ok = uses_index ("SELECT sha1 FROM Files WHERE count = 0;", 0) && ok;
+	ok = uses_index ("SELECT sha1 FROM main.Files ORDER BY watchtime DESC LIMIT 10;", 10) && ok;
+
+	close_entrydb ();
+	unlink (filename);
+	return ok && sum_exec == sum_stmt ? 0 : 1;
 }
+#endif /* ENTRYDB_BENCH */
@@ -1,14 +1,51 @@
 #ifndef ENTRYDB_H
 #define ENTRYDB_H
 #include <stdbool.h>
+#include <time.h>
 #include "entry.h"
 
+/* A row of the Files table, kept in memory while the database is open. */
+struct file_row
+{
+	unsigned char key[KEY_SIZE];
+	int count;
+	double watchtime;
+	double length;
+};
+
+/* Columns of Files that filters can depend on */
+#define COLUMN_COUNT		0x01
+#define COLUMN_WATCHTIME	0x02
+#define COLUMN_LENGTH		0x04
+#define COLUMN_OTHER		0x08
+#define COLUMN_ALL		0x0f
+
 bool open_entrydb (char *filename);
 void close_entrydb (void);
+void entrydb_suspend (void);
+void entrydb_resume (void);
+
+bool entrydb_get_int (struct atrfs_entry *ent, char *attr, int *val);
+bool entrydb_get_double (struct atrfs_entry *ent, char *attr, double *val);
+void entrydb_put_int (struct atrfs_entry *ent, char *attr, int val);
+void entrydb_put_double (struct atrfs_entry *ent, char *attr, double val);
+
+void entrydb_flush (void);
+struct timespec *entrydb_writeback (struct timespec *ts);
+
+bool entrydb_foreach_key (char *sql, void (*fn)(char *text, unsigned char *key));
+bool entrydb_foreach_key_of (char *sql, unsigned char *key,
+			     void (*fn)(char *text, unsigned char *key));
+void entrydb_ensure_exists (unsigned char *sha1);
+
+int entrydb_find_fingerprint (unsigned char *fingerprint, unsigned char *sha1);
+void entrydb_set_fingerprint (unsigned char *sha1, unsigned char *fingerprint);
+void entrydb_rekey (unsigned char *old, unsigned char *new);
 
-char *entrydb_get (struct atrfs_entry *ent, char *attr);
-void entrydb_put (struct atrfs_entry *ent, char *attr, char *val);
+size_t entrydb_top_rows (char *attr, size_t k, bool smallest,
+			 bool (*want)(struct file_row *row), struct file_row **top);
 
-void entrydb_ensure_exists (char *sha1);
+unsigned int entrydb_column (const char *name);
+unsigned int entrydb_columns_of (char *sql);
 
 #endif /* ! ENTRYDB_H */
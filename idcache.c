@@ -0,0 +1,337 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <attr/xattr.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "idcache.h"
+#include "sha1.h"
+#include "util.h"
+
+/*
+ * The SHA1 of a file is cached together with a stamp made of
+ * (st_dev, st_ino, st_size, st_mtim). A cached SHA1 is used only
+ * while the stamp still matches the file, so rewritten files are
+ * hashed again.
+ *
+ * The cache lives in the user.sha1 and user.sha1stamp attributes
+ * of the file. On filesystems without user attributes (NFS, exFAT)
+ * it lives in a side file: an open addressing hash table that is
+ * mapped into memory as a whole.
+ */
+
+#define IDCACHE_MAGIC "ATRFSID"
+#define IDCACHE_VERSION 1
+#define IDCACHE_MIN_SLOTS 4096
+
+struct idcache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;	/* power of two */
+	uint32_t used;
+	uint32_t reserved[11];
+};
+
+struct idcache_slot
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	unsigned char sha1[KEY_SIZE];
+	uint32_t in_use;
+	uint32_t reserved[2];
+};
+
+static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *idcache_name;
+static int idcache_fd = -1;
+static struct idcache_header *idcache;
+static size_t idcache_size;
+
+#define SLOTS(hdr) ((struct idcache_slot *)((hdr) + 1))
+
+static uint64_t mtime_ns (struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+static uint32_t slot_hash (uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+static struct idcache_slot *find_slot (struct idcache_header *hdr, uint64_t dev, uint64_t ino)
+{
+	uint32_t mask = hdr->nslots - 1;
+	uint32_t i = slot_hash (dev, ino) & mask;
+	struct idcache_slot *slots = SLOTS(hdr);
+
+	while (slots[i].in_use && (slots[i].dev != dev || slots[i].ino != ino))
+		i = (i + 1) & mask;
+	return &slots[i];
+}
+
+static struct idcache_header *map_file (int fd, size_t *size)
+{
+	struct stat st;
+	struct idcache_header *hdr;
+
+	if (fstat (fd, &st) < 0 || st.st_size < sizeof (*hdr))
+		return NULL;
+
+	hdr = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return NULL;
+
+	/* find_slot() masks with nslots - 1 and needs a free slot to stop. */
+	if (memcmp (hdr->magic, IDCACHE_MAGIC, 8) || hdr->version != IDCACHE_VERSION ||
+	    hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) || hdr->used >= hdr->nslots ||
+	    st.st_size != sizeof (*hdr) + hdr->nslots * sizeof (struct idcache_slot))
+	{
+		munmap (hdr, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return hdr;
+}
+
+/* Create a new side file with NSLOTS slots, filled from OLD. */
+static bool create_file (uint32_t nslots, struct idcache_header *old)
+{
+	char *tmpname = NULL;
+	struct idcache_header *hdr;
+	size_t size = sizeof (*hdr) + nslots * sizeof (struct idcache_slot);
+	int fd;
+	uint32_t i;
+
+	asprintf (&tmpname, "%s.tmp", idcache_name);
+	fd = open (tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate (fd, size) < 0)
+		goto err;
+
+	hdr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto err;
+
+	memcpy (hdr->magic, IDCACHE_MAGIC, 8);
+	hdr->version = IDCACHE_VERSION;
+	hdr->nslots = nslots;
+	hdr->used = 0;
+
+	for (i = 0; old && i < old->nslots; i++)
+	{
+		struct idcache_slot *s = &SLOTS(old)[i];
+		if (s->in_use)
+		{
+			*find_slot (hdr, s->dev, s->ino) = *s;
+			hdr->used++;
+		}
+	}
+
+	if (rename (tmpname, idcache_name) < 0)
+	{
+		munmap (hdr, size);
+		goto err;
+	}
+
+	if (idcache)
+		munmap (idcache, idcache_size);
+	if (idcache_fd >= 0)
+		close (idcache_fd);
+	idcache = hdr;
+	idcache_size = size;
+	idcache_fd = fd;
+	free (tmpname);
+	return true;
+err:
+	tmplog ("Can't create identity cache %s\n", tmpname);
+	if (fd >= 0)
+		close (fd);
+	unlink (tmpname);
+	free (tmpname);
+	return false;
+}
+
+/*
+ * Use FILENAME as the side file. It is created when the first
+ * SHA1 can't be stored into the attributes of a file.
+ */
+void idcache_open (char *filename)
+{
+	pthread_mutex_lock (&idcache_lock);
+	if (idcache)
+	{
+		munmap (idcache, idcache_size);
+		close (idcache_fd);
+		idcache = NULL;
+		idcache_fd = -1;
+	}
+	free (idcache_name);
+
+	/* We chdir to the mount point later, so remember the full path. */
+	if (filename[0] == '/')
+	{
+		idcache_name = strdup (filename);
+	} else {
+		char *pwd = get_current_dir_name ();
+		asprintf (&idcache_name, "%s/%s", pwd, filename);
+		free (pwd);
+	}
+
+	idcache_fd = open (idcache_name, O_RDWR | O_CLOEXEC);
+	if (idcache_fd >= 0)
+	{
+		idcache = map_file (idcache_fd, &idcache_size);
+		if (! idcache)
+		{
+			tmplog ("Ignoring invalid identity cache %s\n", idcache_name);
+			close (idcache_fd);
+			idcache_fd = -1;
+		}
+	}
+	pthread_mutex_unlock (&idcache_lock);
+}
+
+void idcache_close (void)
+{
+	pthread_mutex_lock (&idcache_lock);
+	if (idcache)
+	{
+		munmap (idcache, idcache_size);
+		close (idcache_fd);
+	}
+	idcache = NULL;
+	idcache_fd = -1;
+	pthread_mutex_unlock (&idcache_lock);
+}
+
+static unsigned char *sidefile_get (struct stat *st, unsigned char *key)
+{
+	unsigned char *ret = NULL;
+
+	pthread_mutex_lock (&idcache_lock);
+	if (idcache)
+	{
+		struct idcache_slot *s = find_slot (idcache, st->st_dev, st->st_ino);
+		if (s->in_use && s->size == st->st_size && s->mtime_ns == mtime_ns (st))
+		{
+			memcpy (key, s->sha1, KEY_SIZE);
+			ret = key;
+		}
+	}
+	pthread_mutex_unlock (&idcache_lock);
+	return ret;
+}
+
+static void sidefile_put (struct stat *st, unsigned char *key)
+{
+	pthread_mutex_lock (&idcache_lock);
+	if (! idcache && idcache_name)
+		create_file (IDCACHE_MIN_SLOTS, NULL);
+
+	/*
+	 * Keep the load factor below 1/2. If the table can't grow,
+	 * find_slot() must still find a free slot: don't fill it.
+	 */
+	if (idcache && 2 * (idcache->used + 1) > idcache->nslots &&
+	    ! create_file (2 * idcache->nslots, idcache))
+		tmplog ("Identity cache %s is full, not caching a SHA1\n", idcache_name);
+	else if (idcache)
+	{
+		struct idcache_slot *s = find_slot (idcache, st->st_dev, st->st_ino);
+		if (! s->in_use)
+			idcache->used++;
+		s->dev = st->st_dev;
+		s->ino = st->st_ino;
+		s->size = st->st_size;
+		s->mtime_ns = mtime_ns (st);
+		memcpy (s->sha1, key, KEY_SIZE);
+		s->in_use = 1;
+	}
+	pthread_mutex_unlock (&idcache_lock);
+}
+
+static unsigned char *xattr_get (char *filename, struct stat *st, unsigned char *key)
+{
+	char stamp[64], cur[64], hex[2 * KEY_SIZE + 1];
+	int len;
+
+	len = getxattr (filename, "user.sha1stamp", stamp, sizeof (stamp) - 1);
+	if (len <= 0)
+		return NULL;
+	stamp[len] = '\0';
+
+	snprintf (cur, sizeof (cur), "%llu %llu",
+		  (unsigned long long)st->st_size, (unsigned long long)mtime_ns (st));
+	if (strcmp (stamp, cur))
+		return NULL;
+
+	len = getxattr (filename, "user.sha1", hex, sizeof (hex));
+	if (len != sizeof (hex) || ! hex_to_key (hex, key))
+		return NULL;
+	return key;
+}
+
+static bool xattr_put (char *filename, struct stat *st, unsigned char *key)
+{
+	char stamp[64], hex[2 * KEY_SIZE + 1];
+
+	snprintf (stamp, sizeof (stamp), "%llu %llu",
+		  (unsigned long long)st->st_size, (unsigned long long)mtime_ns (st));
+
+	/* Setting attributes changes only st_ctime, so the stamp stays valid. */
+	key_to_hex (key, hex);
+	if (setxattr (filename, "user.sha1", hex, sizeof (hex), 0) ||
+	    setxattr (filename, "user.sha1stamp", stamp, strlen (stamp), 0))
+		return false;
+	return true;
+}
+
+/*
+ * Store the cached SHA1 of FILENAME into KEY. Return NULL
+ * if there is none or if the file has changed.
+ */
+unsigned char *get_sha1_cached_r (char *filename, unsigned char *key)
+{
+	struct stat st;
+
+	if (stat (filename, &st) < 0)
+		return NULL;
+	if (sidefile_get (&st, key))
+		return key;
+	return xattr_get (filename, &st, key);
+}
+
+/*
+ * Store the SHA1 of FILENAME into KEY, hashing the file only
+ * when there is no valid cached SHA1. This is safe to call from
+ * the hashing threads. Return NULL if the file can't be read;
+ * nothing is cached then, so a read error is not remembered.
+ */
+unsigned char *get_sha1_fast_r (char *filename, unsigned char *key)
+{
+	struct stat st;
+
+	if (stat (filename, &st) < 0)
+		return get_sha1_r (filename, key);
+
+	if (sidefile_get (&st, key) || xattr_get (filename, &st, key))
+		return key;
+
+	/* The stamp is taken before hashing: a file changing meanwhile is hashed again. */
+	if (! get_sha1_r (filename, key))
+		return NULL;
+	if (! xattr_put (filename, &st, key))
+		sidefile_put (&st, key);
+	return key;
+}
@@ -0,0 +1,10 @@
+#ifndef IDCACHE_H
+#define IDCACHE_H
+
+void idcache_open (char *filename);
+void idcache_close (void);
+
+unsigned char *get_sha1_cached_r (char *filename, unsigned char *key);
+unsigned char *get_sha1_fast_r (char *filename, unsigned char *key);
+
+#endif /* IDCACHE_H */
@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "entry.h"
+#include "inval.h"
+#include "util.h"
+
+/*
+ * The kernel caches the names and attributes for CACHE_TIMEOUT, so it
+ * must be told when the tree changes. The changes are collected here
+ * as they are made, and inval_flush() in the main loop hands them to
+ * a thread of their own. A notification about a directory waits for
+ * the operations in it, and they may wait for a reply from us, so
+ * the notifications are never written by a thread that processes
+ * requests or holds tree_lock.
+ */
+
+struct inval
+{
+	fuse_ino_t parent;
+	char *name;		/* NULL to invalidate the attributes of PARENT */
+};
+
+static struct fuse_chan *chan;
+static pthread_t sender;
+static bool sender_running;
+static bool sender_quit;
+static bool supported = true;
+
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static GHashTable *inodes;	/* inodes to invalidate */
+static GPtrArray *entries;	/* struct invals */
+static bool flushed;		/* the sender may take them */
+
+static fuse_ino_t entry_ino (struct atrfs_entry *ent)
+{
+	return ent == root ? FUSE_ROOT_ID : (fuse_ino_t)ent;
+}
+
+static void send_invals (GHashTable *inos, GPtrArray *ents)
+{
+	GHashTableIter iter;
+	gpointer ino;
+	int i, err = 0;
+
+	/* The names first: their lookups then see the new attributes. */
+	for (i = 0; ents && i < ents->len; i++)
+	{
+		struct inval *in = g_ptr_array_index (ents, i);
+		if (supported)
+			err = fuse_lowlevel_notify_inval_entry (chan, in->parent,
+								in->name, strlen (in->name));
+		if (err == -ENOSYS)
+			supported = false;
+		free (in->name);
+		free (in);
+	}
+
+	if (inos)
+		g_hash_table_iter_init (&iter, inos);
+	while (inos && supported && g_hash_table_iter_next (&iter, &ino, NULL))
+	{
+		/* -ENOENT: the kernel didn't have it. */
+		err = fuse_lowlevel_notify_inval_inode (chan, (fuse_ino_t)ino, 0, 0);
+		if (err == -ENOSYS)
+			supported = false;
+	}
+
+	if (! supported)
+		tmplog ("The kernel can't invalidate its caches\n");
+	if (ents)
+		g_ptr_array_free (ents, TRUE);
+	if (inos)
+		g_hash_table_destroy (inos);
+}
+
+static void *sender_thread (void *unused)
+{
+	pthread_mutex_lock (&inval_lock);
+	for (;;)
+	{
+		GHashTable *inos;
+		GPtrArray *ents;
+
+		while (! flushed && ! sender_quit)
+			pthread_cond_wait (&inval_cond, &inval_lock);
+		if (! flushed)
+			break;
+
+		inos = inodes;
+		ents = entries;
+		inodes = NULL;
+		entries = NULL;
+		flushed = false;
+
+		pthread_mutex_unlock (&inval_lock);
+		send_invals (inos, ents);
+		pthread_mutex_lock (&inval_lock);
+	}
+	pthread_mutex_unlock (&inval_lock);
+	return NULL;
+}
+
+/* Send the notifications to CH from now on. */
+void inval_start (struct fuse_chan *ch)
+{
+	chan = ch;
+}
+
+/* The attributes or the contents of ENT have changed. */
+void inval_inode (struct atrfs_entry *ent)
+{
+	if (! chan || ! supported)
+		return;
+
+	pthread_mutex_lock (&inval_lock);
+	if (! inodes)
+		inodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_add (inodes, (gpointer)entry_ino (ent));
+	pthread_mutex_unlock (&inval_lock);
+}
+
+/* NAME is no longer in DIR, or it is another entry. */
+void inval_entry (struct atrfs_entry *dir, const char *name)
+{
+	struct inval *in;
+
+	if (! chan || ! supported)
+		return;
+
+	in = malloc (sizeof (*in));
+	if (! in)
+		abort ();
+	in->parent = entry_ino (dir);
+	in->name = strdup (name);
+
+	pthread_mutex_lock (&inval_lock);
+	if (! entries)
+		entries = g_ptr_array_new ();
+	g_ptr_array_add (entries, in);
+	pthread_mutex_unlock (&inval_lock);
+}
+
+/* Called by the main loop: send what has changed since the last time. */
+void inval_flush (void)
+{
+	if (! chan)
+		return;
+
+	pthread_mutex_lock (&inval_lock);
+	/* Started here, after fuse_daemonize(). */
+	if (! sender_running && pthread_create (&sender, NULL, sender_thread, NULL) == 0)
+		sender_running = true;
+	if ((inodes || entries) && ! flushed)
+	{
+		flushed = true;
+		pthread_cond_signal (&inval_cond);
+	}
+	pthread_mutex_unlock (&inval_lock);
+}
+
+/* Stop the sender before the channel goes away. */
+void inval_stop (void)
+{
+	if (! sender_running)
+		return;
+
+	pthread_mutex_lock (&inval_lock);
+	sender_quit = true;
+	pthread_cond_signal (&inval_cond);
+	pthread_mutex_unlock (&inval_lock);
+	pthread_join (sender, NULL);
+	sender_running = false;
+	chan = NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef INVAL_H
+#define INVAL_H
+#include <fuse/fuse_lowlevel.h>
+#include "entry.h"
+
+/* How long the kernel may cache names and attributes; see inval.c */
+#define CACHE_TIMEOUT 3600.0
+
+void inval_start (struct fuse_chan *ch);
+void inval_inode (struct atrfs_entry *ent);
+void inval_entry (struct atrfs_entry *dir, const char *name);
+void inval_flush (void);
+void inval_stop (void);
+
+#endif /* INVAL_H */
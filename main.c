@@ -1,114 +1,698 @@
 /* main.c - 20.7.2008 - 9.7.2010 Ari & Tero Roponen */
 #include <sys/inotify.h>
 #include <errno.h>
-#include <ftw.h>
 #include <fuse.h>
 #include <fuse/fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 #include "atrfs_ops.h"
+#include "dispatch.h"
 #include "entry.h"
 #include "entrydb.h"
 #include "entry_filter.h"
+#include "idcache.h"
+#include "inval.h"
+#include "media.h"
+#include "sha1.h"
+#include "snapshot.h"
 #include "util.h"
 #include "subtitles.h"
+#include "verify.h"
+#include "walk.h"
+#include "workqueue.h"
 
 /* In statistics.c. */
 extern struct atrfs_entry *statroot;
+extern void categorize_file_entry (struct atrfs_entry *ent);
+extern struct atrfs_entry *add_file_config (struct atrfs_entry *ent);
+
+/* In notify.c. */
+extern void add_notify(const char *dirname, uint32_t mask);
+extern void add_notify_entry(struct atrfs_entry *ent);
+extern void remove_notify_entry(struct atrfs_entry *ent);
+extern void handle_notify(void);
 
 GHashTable *sha1_to_entry_map;
 
-extern char *get_sha1 (char *filename);
-extern char *get_sha1_fast (char *filename);
+/*
+ * Files found by the scan are hashed in parallel. Before mounting
+ * they are added to the tree only after every hash is known, in the
+ * order of their paths; the background scan adds each one as soon as
+ * it is hashed.
+ */
+struct scanned_file
+{
+	char *filename;
+	unsigned char sha1[KEY_SIZE];
+	unsigned char fingerprint[KEY_SIZE];
+	struct file_stamp stamp;
+	bool has_fingerprint;
+	bool verified;
+	bool unreadable;	/* hashing failed: no entry is made */
+};
+
+static GPtrArray *scanned_files;
+static pthread_mutex_t scanned_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct workqueue *hash_queue;
+static int hash_threads;
+
+/* Threads processing FUSE requests; see dispatch.c */
+static int fuse_threads;
+
+/* Paths to search files, from the configuration file */
+static GPtrArray *config_paths;
+
+/*
+ * The background scan: one job of scan_queue walks the configured
+ * paths and the other threads hash the files it finds. The main loop adds
+ * every file to the tree as soon as its hash is ready. It is used
+ * when the tree comes from a snapshot, or with mount-first=1. A
+ * lookup of a file not added yet fails; the kernel doesn't cache
+ * that, so the name is found once the file is in the tree.
+ */
+static struct workqueue *scan_queue;
+static bool mount_first;
+static bool scan_pending;	/* to be started by the main loop */
+static bool scan_walking;
+static int scan_found;		/* files given to the hashing threads */
+static int scan_added;
+static double scan_start, scan_end;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Files whose fingerprint is ambiguous, to be hashed in full. The
+ * walker may fill scan_queue, so they are given to it only when it
+ * has room, as the work queues of verify.c and media.c are fed.
+ */
+static GPtrArray *rehash_pending;
+
+/*
+ * When the tree is restored from a snapshot, real path -> restored_file
+ * until the scan has walked every path.
+ */
+struct restored_file
+{
+	struct atrfs_entry *ent;
+	struct file_stamp stamp;	/* from the snapshot */
+	bool seen;			/* found by the scan */
+	bool changed;			/* found with another stamp */
+};
+
+static GHashTable *restored_files;
+
+static void start_scan(void);
 
-struct pollfd pfd[2];
+struct pollfd pfd[6];
 static sigset_t sigs;
 
+/*
+ * The main loop reads the FUSE requests and handles the events of
+ * the background jobs. It takes tree_lock only when it has something
+ * else than requests to do, so that it doesn't stop the FUSE threads
+ * for every request it reads.
+ */
 static int atrfs_session_loop(struct fuse_session *se)
 {
-	int res = 0;
+	int res = 0, ret = 0;
 	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
 	char buf[fuse_chan_bufsize(ch)];
+	struct timespec ts, *timeout = NULL;
+	double writeback = 0.0;	/* when the pending writes go, if timeout */
+	bool busy = true;
 
 	sigfillset(&sigs);
 	pfd[0].fd = fuse_chan_fd(ch);
 	pfd[0].events = POLLIN;
 
-	while (!fuse_session_exited(se))
+	verify_start();
+	pfd[2].fd = verify_fd();
+	pfd[2].events = POLLIN;
+
+	start_scan();
+	pfd[3].fd = scan_queue ? workqueue_fd(scan_queue) : -1;
+	pfd[3].events = POLLIN;
+
+	media_start();
+	pfd[4].fd = media_fd();
+	pfd[4].events = POLLIN;
+
+	void process(char *req, size_t len)
 	{
-		int ret = ppoll(pfd, 2, NULL, &sigs);
+		fuse_session_process(se, req, len, ch);
+	}
+	dispatch_init(fuse_threads, process);
+	pfd[5].fd = dispatch_fd();
+	pfd[5].events = POLLIN;
+	inval_start(ch);
 
-		if (ret == -1)
+	while (!fuse_session_exited(se))
+	{
+		if (busy)
 		{
-		} else if (ret == 0) /* timeout */ {
-		} else {
-			/* inotify events */
-			if (pfd[1].revents)
-				handle_notify();
-
-			/* FUSE events */
-			if (pfd[0].revents)
+			pthread_rwlock_wrlock(&tree_lock);
+			if (ret > 0)
 			{
-				res = fuse_chan_receive(ch, buf, sizeof(buf));
-				if (!res)
-					continue;
+				/* inotify events */
+				if (pfd[1].revents)
+					handle_notify();
+
+				/* Background hashing */
+				if (pfd[2].revents)
+					handle_verify();
 
-				if (res == -1)
-					break;
+				/* Background scan */
+				if (pfd[3].revents)
+					workqueue_complete(scan_queue);
+
+				/* Media properties */
+				if (pfd[4].revents)
+					handle_media();
+
+				/* Requests that changed the tree */
+				if (pfd[5].revents)
+					dispatch_complete();
+			}
 
-				fuse_session_process(se, buf, res, ch);
+			/* Wake up when pending attribute writes must go to the writer. */
+			timeout = entrydb_writeback(&ts);
+			if (timeout)
+				writeback = doubletime() + ts.tv_sec + ts.tv_nsec / 1e9;
+
+			snapshot_tick();
+			inval_flush();
+			pthread_rwlock_unlock(&tree_lock);
+		} else if (timeout) {
+			/* Requests don't move the deadline. */
+			double left = writeback - doubletime();
+			if (left < 0.0)
+				left = 0.0;
+			ts.tv_sec = left;
+			ts.tv_nsec = (left - ts.tv_sec) * 1e9;
+		}
+
+		ret = ppoll(pfd, 6, timeout, &sigs);
+
+		/* FUSE events */
+		if (ret > 0 && pfd[0].revents)
+		{
+			res = fuse_chan_receive(ch, buf, sizeof(buf));
+			if (res > 0)
+			{
+				dispatch_request(buf, res);
 				res = 0;
 			}
 		}
+		if (res == -1)
+			break;
+
+		/*
+		 * Requests processed by the loop itself may leave writes
+		 * and invalidations, like the threads tell with pfd[5].
+		 */
+		busy = ret == 0 || pfd[5].fd < 0 ||
+			(ret > 0 && (pfd[1].revents || pfd[2].revents || pfd[3].revents ||
+				     pfd[4].revents || pfd[5].revents));
 	}
 
+	dispatch_destroy();
+	inval_stop();
 	fuse_session_reset(se);
 	return res;
 }
 
-static void add_file_when_supported(const char *filename)
+static void hash_scanned_file(void *data)
 {
-	struct atrfs_entry *ent;
-	char *uniq_name;
-	char *ext = strrchr (filename, '.');
-	if (!ext)
-		return;
+	struct scanned_file *sf = data;
 
-	/* Currently we support only files of type .flv and .webm. */
-	if (strcmp (ext, ".flv") && strcmp(ext, ".webm"))
-		return;
+	/* In fingerprint mode only already known SHA1s are used. */
+	if (fingerprint_mode && ! get_sha1_cached_r (sf->filename, sf->sha1))
+	{
+		sf->has_fingerprint = get_fingerprint_r (sf->filename, sf->fingerprint) != NULL;
+		sf->unreadable = ! sf->has_fingerprint;
+	} else
+		sf->unreadable = ! get_sha1_fast_r (sf->filename, sf->sha1);
+}
+
+static void full_hash_scanned_file(void *data)
+{
+	struct scanned_file *sf = data;
+	sf->unreadable = ! get_sha1_fast_r (sf->filename, sf->sha1);
+	sf->verified = ! sf->unreadable;
+}
+
+/*
+ * Find the Files key of every fingerprinted file. A fingerprint
+ * that is shared by several rows or by several scanned files may
+ * be a collision, so those files are hashed completely now.
+ * Otherwise the key of the matching row or the fingerprint itself
+ * is used until the background verification is done.
+ */
+static void resolve_fingerprints(void)
+{
+	GHashTable *seen = g_hash_table_new (key_hash, key_equal);
+	int i;
+
+	for (i = 0; i < scanned_files->len; i++)
+	{
+		struct scanned_file *sf = g_ptr_array_index (scanned_files, i);
+		if (sf->has_fingerprint)
+		{
+			int n = GPOINTER_TO_INT (g_hash_table_lookup (seen, sf->fingerprint));
+			g_hash_table_replace (seen, sf->fingerprint, GINT_TO_POINTER (n + 1));
+		}
+	}
+
+	for (i = 0; i < scanned_files->len; i++)
+	{
+		struct scanned_file *sf = g_ptr_array_index (scanned_files, i);
+		int rows;
+
+		if (! sf->has_fingerprint)
+			continue;
+
+		rows = entrydb_find_fingerprint (sf->fingerprint, sf->sha1);
+		if (rows > 1 || GPOINTER_TO_INT (g_hash_table_lookup (seen, sf->fingerprint)) > 1)
+		{
+			workqueue_add (hash_queue, full_hash_scanned_file, NULL, sf);
+		} else if (rows == 0) {
+			memcpy (sf->sha1, sf->fingerprint, KEY_SIZE);
+			entrydb_ensure_exists (sf->sha1);
+			entrydb_set_fingerprint (sf->sha1, sf->fingerprint);
+		}
+	}
+
+	workqueue_wait (hash_queue);
+	g_hash_table_destroy (seen);
+
+	for (i = 0; i < scanned_files->len; i++)
+	{
+		struct scanned_file *sf = g_ptr_array_index (scanned_files, i);
+		if (sf->verified)
+		{
+			entrydb_ensure_exists (sf->sha1);
+			entrydb_set_fingerprint (sf->sha1, sf->fingerprint);
+		}
+	}
+}
+
+/* Currently we support only files of type .flv and .webm. */
+static const char *supported_exts[] = { ".flv", ".webm", NULL };
 
-	uniq_name = uniquify_name(basename(filename), root);
+static struct scanned_file *new_scanned_file(const char *filename, const struct stat *sb)
+{
+	struct scanned_file *sf = malloc (sizeof (*sf));
+	if (! sf)
+		abort ();
+	sf->filename = strdup (filename);
+	stat_to_stamp (sb, &sf->stamp);
+	sf->has_fingerprint = false;
+	sf->verified = false;
+	sf->unreadable = false;
+	return sf;
+}
+
+/* Forget the scanned file SF, which could not be hashed. */
+static void drop_scanned_file(struct scanned_file *sf)
+{
+	tmplog ("Can't read %s\n", sf->filename);
+	free (sf->filename);
+	free (sf);
+}
+
+/* Called from the walking threads, see scan_config_paths(). */
+static void add_file_when_supported(const char *filename, const struct stat *sb, void *unused)
+{
+	struct scanned_file *sf = new_scanned_file (filename, sb);
+
+	pthread_mutex_lock (&scanned_files_lock);
+	g_ptr_array_add (scanned_files, sf);
+	pthread_mutex_unlock (&scanned_files_lock);
+	workqueue_add (hash_queue, hash_scanned_file, NULL, sf);
+}
+
+/* Make an entry in root for the hashed file SF and free SF. */
+static struct atrfs_entry *add_file_entry(struct scanned_file *sf)
+{
+	struct atrfs_entry *ent, *other;
+	char *uniq_name;
+
+	uniq_name = uniquify_name(basename(sf->filename));
 
 	ent = create_entry (ATRFS_FILE_ENTRY);
 	attach_entry (root, ent, uniq_name);
 
-	REAL_NAME(ent) = strdup(filename);
+	REAL_NAME(ent) = sf->filename;
 	free(uniq_name);
 
-	char *sha1 = get_sha1_fast (REAL_NAME(ent));
-	entrydb_ensure_exists (sha1);
-	g_hash_table_replace (sha1_to_entry_map, strdup(sha1), ent);
+	memcpy (FILE_ENTRY(ent)->key, sf->sha1, KEY_SIZE);
+	FILE_ENTRY(ent)->has_key = true;
+	FILE_ENTRY(ent)->stamp = sf->stamp;
+	entrydb_ensure_exists (sf->sha1);
+	other = g_hash_table_lookup (sha1_to_entry_map, FILE_ENTRY(ent)->key);
+	if (other)
+		unrank_entry (other);
+	g_hash_table_replace (sha1_to_entry_map, FILE_ENTRY(ent)->key, ent);
+	rank_entry (ent);
+	add_notify_entry (ent);
+	media_prefetch (ent);
+
+	if (sf->has_fingerprint && ! sf->verified)
+		verify_entry (ent, sf->fingerprint);
+	free (sf);
+	return ent;
 }
 
-static void for_each_file (char *dir_or_file, void (*file_handler)(const char *filename))
+/*
+ * Wait for the hashing threads and build the tree from their results.
+ * The walk finds the files in no particular order, so they are added
+ * by path: the same files get the same names on every start.
+ */
+static void add_scanned_files(void)
 {
-	int handler (const char *fpath, const struct stat *sb, int type)
+	int i;
+
+	int by_path (gconstpointer a, gconstpointer b)
+	{
+		const struct scanned_file *sa = *(struct scanned_file **)a;
+		const struct scanned_file *sb = *(struct scanned_file **)b;
+		return strcmp (sa->filename, sb->filename);
+	}
+
+	workqueue_wait (hash_queue);
+	if (fingerprint_mode)
+		resolve_fingerprints ();
+	workqueue_destroy (hash_queue);
+	hash_queue = NULL;
+
+	g_ptr_array_sort (scanned_files, by_path);
+
+	for (i = 0; i < scanned_files->len; i++)
 	{
-		if (type == FTW_F)
-			file_handler (fpath);
-		else if (type == FTW_D)
-			add_notify(fpath,
-				IN_CREATE |
-				IN_DELETE |
-				IN_MOVED_FROM |
-				IN_MOVED_TO);
-		return 0;
+		struct scanned_file *sf = g_ptr_array_index (scanned_files, i);
+		if (sf->unreadable)
+			drop_scanned_file (sf);
+		else
+			add_file_entry (sf);
 	}
-	ftw (dir_or_file, handler, 10);
+
+	g_ptr_array_free (scanned_files, TRUE);
+	scanned_files = NULL;
+}
+
+#define NOTIFY_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static void watch_dir (const char *dirname, void *unused)
+{
+	add_notify (dirname, NOTIFY_MASK);
+}
+
+static int walk_threads (void)
+{
+	return hash_threads > 0 ? hash_threads : default_thread_count ();
+}
+
+/* Scan every configured path and build the tree of the found files. */
+static void scan_config_paths (void)
+{
+	struct walk_ops ops = { supported_exts, add_file_when_supported, watch_dir };
+	int n = walk_threads ();
+	int i;
+
+	hash_queue = workqueue_new (n, 4 * n);
+	scanned_files = g_ptr_array_new ();
+	for (i = 0; config_paths && i < config_paths->len; i++)
+		walk_tree (g_ptr_array_index (config_paths, i), &ops, n, NULL);
+	add_scanned_files ();
+}
+
+static bool scan_running (void)
+{
+	bool running;
+
+	pthread_mutex_lock (&scan_lock);
+	running = scan_walking || scan_added < scan_found;
+	pthread_mutex_unlock (&scan_lock);
+	return running;
+}
+
+static void scan_check_done (void)
+{
+	if (scan_queue && ! scan_running () && scan_end == 0.0)
+	{
+		scan_end = doubletime ();
+		tmplog ("Scan done: %d files in %.1f s\n", scan_added, scan_end - scan_start);
+	}
+}
+
+/*
+ * Done callback of the hashing: put the file in the tree. Here,
+ * unlike resolve_fingerprints(), the other files of the scan are not
+ * known yet, so a fingerprint shared with another new file is found
+ * only by the verification.
+ */
+static void add_hashed_file (void *data);
+
+static void rehash_start (void)
+{
+	while (rehash_pending && rehash_pending->len > 0 &&
+	       workqueue_try_add (scan_queue, full_hash_scanned_file, add_hashed_file,
+				  g_ptr_array_index (rehash_pending, rehash_pending->len - 1)))
+		g_ptr_array_remove_index (rehash_pending, rehash_pending->len - 1);
+}
+
+static void add_hashed_file (void *data)
+{
+	struct scanned_file *sf = data;
+	struct atrfs_entry *ent;
+
+	/* A job of scan_queue is done: there is room for one. */
+	rehash_start ();
+
+	if (sf->unreadable)
+	{
+		pthread_mutex_lock (&scan_lock);
+		scan_found--;
+		pthread_mutex_unlock (&scan_lock);
+		drop_scanned_file (sf);
+		scan_check_done ();
+		return;
+	}
+
+	if (sf->verified)
+	{
+		entrydb_ensure_exists (sf->sha1);
+		entrydb_set_fingerprint (sf->sha1, sf->fingerprint);
+	} else if (sf->has_fingerprint) {
+		int rows = entrydb_find_fingerprint (sf->fingerprint, sf->sha1);
+		if (rows > 1)
+		{
+			if (! rehash_pending)
+				rehash_pending = g_ptr_array_new ();
+			g_ptr_array_add (rehash_pending, sf);
+			rehash_start ();
+			return;
+		} else if (rows == 0) {
+			memcpy (sf->sha1, sf->fingerprint, KEY_SIZE);
+			entrydb_ensure_exists (sf->sha1);
+			entrydb_set_fingerprint (sf->sha1, sf->fingerprint);
+		}
+	}
+
+	ent = add_file_entry (sf);
+	categorize_file_entry (ent);
+	verify_start ();
+	scan_added++;
+	scan_check_done ();
+}
+
+/*
+ * The walk. Files of a restored tree are only compared with their
+ * stamps in the snapshot; other files are given to the hashing
+ * threads. The directories are watched as they are found.
+ */
+static void scan_paths (void *unused)
+{
+	void file_found (const char *filename, const struct stat *sb, void *unused)
+	{
+		struct restored_file *rf = NULL;
+		struct file_stamp stamp;
+
+		if (restored_files)
+			rf = g_hash_table_lookup (restored_files, filename);
+		if (rf)
+		{
+			stat_to_stamp (sb, &stamp);
+			rf->seen = true;
+			rf->changed = ! same_stamp (&stamp, &rf->stamp);
+			return;
+		}
+
+		pthread_mutex_lock (&scan_lock);
+		scan_found++;
+		pthread_mutex_unlock (&scan_lock);
+		workqueue_add (scan_queue, hash_scanned_file, add_hashed_file,
+			       new_scanned_file (filename, sb));
+	}
+
+	struct walk_ops ops = { supported_exts, file_found, watch_dir };
+	int i;
+
+	for (i = 0; config_paths && i < config_paths->len; i++)
+		walk_tree (g_ptr_array_index (config_paths, i), &ops, walk_threads (), NULL);
+}
+
+/* A file of the snapshot is gone: take it out of the tree. */
+static void remove_file (struct atrfs_entry *ent)
+{
+	struct atrfs_entry *parent = ent->parent;
+
+	if (g_hash_table_lookup (sha1_to_entry_map, FILE_ENTRY(ent)->key) == ent)
+		g_hash_table_remove (sha1_to_entry_map, FILE_ENTRY(ent)->key);
+	unrank_entry (ent);
+	remove_notify_entry (ent);
+
+	/* The kernel may still know the inode, so the entry is kept. */
+	detach_entry (ent);
+	ent->flags |= ENTRY_DELETED;
+	while (parent != root && g_hash_table_size (DIR_ENTRY(parent)->contents) == 0)
+	{
+		struct atrfs_entry *tmp = parent->parent;
+		detach_entry (parent);
+		parent->flags |= ENTRY_DELETED;
+		parent = tmp;
+	}
+}
+
+/* Done callback of the walk: reconcile the restored files. */
+static void scan_walked (void *unused)
+{
+	GHashTableIter iter;
+	struct restored_file *rf;
+	int changed = 0, removed = 0;
+
+	if (restored_files)
+	{
+		g_hash_table_iter_init (&iter, restored_files);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&rf))
+		{
+			struct atrfs_file_entry *fent = FILE_ENTRY(rf->ent);
+
+			if (! rf->seen)
+			{
+				remove_file (rf->ent);
+				removed++;
+			} else if (rf->changed || fent->provisional) {
+				verify_entry (rf->ent, fent->provisional ? fent->key : NULL);
+				changed++;
+			}
+		}
+		verify_start ();
+		g_hash_table_destroy (restored_files);
+		restored_files = NULL;
+		tmplog ("Snapshot reconciled: %d changed, %d removed\n", changed, removed);
+	}
+
+	pthread_mutex_lock (&scan_lock);
+	scan_walking = false;
+	pthread_mutex_unlock (&scan_lock);
+	scan_check_done ();
+}
+
+/* Start the background scan, if one is wanted. */
+static void start_scan (void)
+{
+	int n = walk_threads ();
+
+	if (! scan_pending)
+		return;
+	scan_pending = false;
+
+	scan_start = doubletime ();
+	scan_walking = true;
+	scan_queue = workqueue_new (n + 1, 4 * n);
+	workqueue_add (scan_queue, scan_paths, scan_walked, NULL);
+}
+
+/* Progress of the background scan; return false if there is none. */
+bool get_scan_progress (int *found, int *added, double *seconds, bool *running)
+{
+	if (! scan_queue)
+		return false;
+
+	*running = scan_running ();
+	pthread_mutex_lock (&scan_lock);
+	*found = scan_found;
+	pthread_mutex_unlock (&scan_lock);
+	*added = scan_added;
+	*seconds = (*running ? doubletime () : scan_end) - scan_start;
+	return true;
+}
+
+static void restore_file (struct snapshot_file *sf)
+{
+	struct atrfs_entry *dir = root;
+	struct atrfs_entry *ent, *other;
+	struct restored_file *rf;
+
+	if (*sf->category)
+	{
+		dir = lookup_entry_by_name (root, sf->category);
+		if (! dir)
+		{
+			dir = create_entry (ATRFS_DIRECTORY_ENTRY);
+			attach_entry (root, dir, sf->category);
+		}
+	}
+
+	ent = create_entry (ATRFS_FILE_ENTRY);
+	attach_entry (dir, ent, sf->name);
+	REAL_NAME(ent) = strdup (sf->path);
+
+	memcpy (FILE_ENTRY(ent)->key, sf->key, KEY_SIZE);
+	FILE_ENTRY(ent)->has_key = true;
+	FILE_ENTRY(ent)->stamp = sf->stamp;
+	FILE_ENTRY(ent)->provisional = sf->provisional;
+	entrydb_ensure_exists (sf->key);
+	other = g_hash_table_lookup (sha1_to_entry_map, FILE_ENTRY(ent)->key);
+	if (other)
+		unrank_entry (other);
+	g_hash_table_replace (sha1_to_entry_map, FILE_ENTRY(ent)->key, ent);
+	rank_entry (ent);
+	add_notify_entry (ent);
+	media_prefetch (ent);
+	if (sf->has_conf)
+		add_file_config (ent);
+
+	rf = malloc (sizeof (*rf));
+	if (! rf)
+		abort ();
+	rf->ent = ent;
+	rf->stamp = sf->stamp;
+	rf->seen = false;
+	rf->changed = false;
+	g_hash_table_replace (restored_files, REAL_NAME(ent), rf);
+}
+
+/*
+ * Build the tree from the snapshot, if there is a usable one, and
+ * let the main loop check it against the configured paths.
+ */
+static bool restore_snapshot (void)
+{
+	restored_files = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free);
+	if (! snapshot_load (restore_file))
+	{
+		g_hash_table_destroy (restored_files);
+		restored_files = NULL;
+		return false;
+	}
+
+	scan_pending = true;
+	return true;
 }
 
 static void parse_config_file (char *datafile, struct atrfs_entry *root)
@@ -133,7 +717,9 @@ static void parse_config_file (char *datafile, struct atrfs_entry *root)
 				case '#': /* Comment */
 					continue;
 				case '/': /* Path to search files */
-					for_each_file (buf, add_file_when_supported);
+					if (! config_paths)
+						config_paths = g_ptr_array_new ();
+					g_ptr_array_add (config_paths, strdup (buf));
 					continue;
 			}
 
@@ -145,6 +731,18 @@ static void parse_config_file (char *datafile, struct atrfs_entry *root)
 				close_entrydb ();
 				if (! open_entrydb (buf + 9))
 					printf ("Can't open %s\n", buf + 9);
+			} else if (strncmp (buf, "hash-threads=", 13) == 0) {
+				hash_threads = atoi (buf + 13);
+			} else if (strncmp (buf, "fuse-threads=", 13) == 0) {
+				fuse_threads = atoi (buf + 13);
+			} else if (strncmp (buf, "idcache=", 8) == 0) {
+				idcache_open (buf + 8);
+			} else if (strncmp (buf, "mount-first=", 12) == 0) {
+				mount_first = atoi (buf + 12) != 0;
+			} else if (strncmp (buf, "snapshot=", 9) == 0) {
+				snapshot_open (buf + 9, datafile);
+			} else if (strncmp (buf, "fingerprint=", 12) == 0) {
+				fingerprint_mode = atoi (buf + 12) != 0;
 			} else if (strncmp (buf, "filter=", 7) == 0) {
 				tmplog("Warning: ignoring old style filter: %s\n", buf);
 			} else if (strncmp (buf, "select ", 7) == 0) {
@@ -161,7 +759,9 @@ extern char *language_list;
 extern int stat_count;
 static void write_statcount(struct atrfs_entry *ent, const char *buf, size_t size)
 {
-	stat_count = atoi(buf);
+	int n = atoi(buf);
+	if (n >= 0)
+		stat_count = n;
 }
 
 static void write_language(struct atrfs_entry *ent, const char *buf, size_t size)
@@ -180,6 +780,8 @@ static void populate_stat_dir(struct atrfs_entry *statroot)
 	attach_entry (statroot, ent, "top-list");
 	ent = create_entry (ATRFS_VIRTUAL_FILE_ENTRY);
 	attach_entry (statroot, ent, "last-list");
+	ent = create_entry (ATRFS_VIRTUAL_FILE_ENTRY);
+	attach_entry (statroot, ent, "count-list");
 
 	ent = create_entry (ATRFS_VIRTUAL_FILE_ENTRY);
 	statcount_ops = *ent->ops;
@@ -196,6 +798,12 @@ static void populate_stat_dir(struct atrfs_entry *statroot)
 	ent->ops = &language_ops;
 	attach_entry (statroot, ent, "language");
 
+	ent = create_entry (ATRFS_VIRTUAL_FILE_ENTRY);
+	attach_entry (statroot, ent, "filters");
+
+	ent = create_entry (ATRFS_VIRTUAL_FILE_ENTRY);
+	attach_entry (statroot, ent, "scan");
+
 	update_stats();
 }
 
@@ -218,27 +826,48 @@ int main(int argc, char *argv[])
 	statroot = create_entry (ATRFS_DIRECTORY_ENTRY);
 	attach_entry (root, statroot, "stats");
 
+	/* Where to cache SHA1s of files that can't have user attributes. */
+	idcache_open ("atrfs.idcache");
+
 	/* Create a mapping from SHA1 to file entry. */
-	sha1_to_entry_map = g_hash_table_new (g_str_hash, g_str_equal);
+	sha1_to_entry_map = g_hash_table_new (key_hash, key_equal);
 
-	parse_config_file (canonicalize_file_name("atrfs.conf"), root);
+	/* The tree is saved here on exit and restored on the next start. */
+	char *config = canonicalize_file_name("atrfs.conf");
+	snapshot_open ("atrfs.snapshot", config);
 
-	tmplog("Hash size: %d\n", g_hash_table_size (sha1_to_entry_map));
+	parse_config_file (config, root);
 
-	/* Categorize file entries. */
-	struct atrfs_entry **entries;
-	size_t count;
-	int i;
+	/*
+	 * A snapshot gives the tree at once; the paths are scanned
+	 * after mounting. With mount-first=1 the tree is built then, too.
+	 */
+	if (restore_snapshot ())
+	{
+	} else if (mount_first) {
+		scan_pending = true;
+	} else {
+		scan_config_paths ();
+
+		tmplog("Hash size: %d\n", g_hash_table_size (sha1_to_entry_map));
 
-	tmplog("cat begins\n");
+		/* Categorize file entries. */
+		struct atrfs_entry **entries;
+		size_t count;
+		int i;
 
-	/* This gives a list of sorted entries. */
-	get_all_file_entries (&entries, &count);
+		tmplog("cat begins\n");
 
-	for (i = 0; i < count; i++)
-		categorize_file_entry (entries[i]);
-	free (entries);
-	tmplog("cat ends\n");
+		/* This gives a list of sorted entries. */
+		get_all_file_entries (&entries, &count);
+
+		prepare_categories ();
+		for (i = 0; i < count; i++)
+			categorize_file_entry (entries[i]);
+		forget_categories ();
+		free (entries);
+		tmplog("cat ends\n");
+	}
 
 	populate_stat_dir (statroot);
 
@@ -259,7 +888,10 @@ int main(int argc, char *argv[])
 				if (fuse_set_signal_handlers(fs) != -1)
 				{
 					fuse_session_add_chan(fs, fc);
+					/* No thread but this one survives daemonizing. */
+					entrydb_suspend();
 					fuse_daemonize(foreground);
+					entrydb_resume();
 
 					fchdir(fd);
 					close(fd);
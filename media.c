@@ -0,0 +1,234 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "entry.h"
+#include "media.h"
+#include "probe.h"
+#include "util.h"
+#include "workqueue.h"
+
+/* In statistics.c */
+extern void categorize_file_entry (struct atrfs_entry *ent);
+
+/*
+ * The length, resolution, codec and keyframe count of the videos are
+ * read here, in the background, and stored in the Files table. The
+ * scan queues the new files whose length is not known, and verify.c
+ * queues the files whose contents have changed. The FUSE handlers
+ * never wait for a probe: they take what is in the table, or report
+ * the value unknown and queue the file.
+ */
+
+#define MEDIA_THREADS 2
+
+struct media_work
+{
+	struct atrfs_entry *ent;
+	unsigned char key[KEY_SIZE];	/* of ENT when it was queued */
+	char *filename;
+	struct media_info info;
+};
+
+static struct workqueue *media_queue;
+static GPtrArray *pending;
+static int next_pending;
+static int running;
+
+/*
+ * What mplayer tells, for files whose headers probe.c can't read.
+ * It is run without a shell, so any file name is passed as it is.
+ */
+static void mplayer_probe (char *filename, struct media_info *info)
+{
+	char buf[256];
+	int fds[2];
+	pid_t pid;
+	FILE *in;
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return;
+
+	pid = fork();
+	if (pid == 0)
+	{
+		int null = open("/dev/null", O_RDWR);
+
+		dup2(fds[1], STDOUT_FILENO);
+		if (null >= 0)
+		{
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		execlp("mplayer", "mplayer", "-identify", "-frames", "0",
+		       "-ao", "null", "-vo", "null", "--", filename, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0)
+	{
+		close(fds[0]);
+		return;
+	}
+
+	in = fdopen(fds[0], "r");
+	if (! in)
+	{
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	while (fgets(buf, sizeof(buf), in))
+	{
+		if (strncmp(buf, "ID_LENGTH=", 10) == 0)
+			info->length = atof(buf + 10);
+		else if (strncmp(buf, "ID_VIDEO_WIDTH=", 15) == 0)
+			info->width = atoi(buf + 15);
+		else if (strncmp(buf, "ID_VIDEO_HEIGHT=", 16) == 0)
+			info->height = atoi(buf + 16);
+		else if (strncmp(buf, "ID_VIDEO_FORMAT=", 16) == 0 && ! info->codec)
+		{
+			char *f = buf + 16;
+			if (! strncasecmp (f, "H264", 4) || ! strncasecmp (f, "avc1", 4))
+				info->codec = CODEC_H264;
+			else if (! strncasecmp (f, "HEVC", 4) || ! strncasecmp (f, "hvc1", 4))
+				info->codec = CODEC_HEVC;
+			else if (! strncasecmp (f, "VP80", 4))
+				info->codec = CODEC_VP8;
+			else if (! strncasecmp (f, "VP90", 4))
+				info->codec = CODEC_VP9;
+			else if (! strncasecmp (f, "AV01", 4))
+				info->codec = CODEC_AV1;
+			else if (! strncasecmp (f, "VP6", 3))
+				info->codec = CODEC_VP6;
+			else if (! strncasecmp (f, "FLV1", 4))
+				info->codec = CODEC_H263;
+		}
+	}
+	fclose(in);
+	waitpid(pid, NULL, 0);
+}
+
+static void probe_file (void *data)
+{
+	struct media_work *w = data;
+
+	/* Starting mplayer takes long, so it is asked only when the headers don't tell. */
+	probe_media (w->filename, &w->info);
+	if (w->info.length <= 0.0)
+		mplayer_probe (w->filename, &w->info);
+}
+
+static void probed (void *data)
+{
+	struct media_work *w = data;
+	struct atrfs_entry *ent = w->ent;
+
+	running--;
+
+	/* Rekeyed meanwhile: verify.c queues the entry again. */
+	if (memcmp (FILE_ENTRY(ent)->key, w->key, KEY_SIZE) == 0)
+	{
+		/* Zero is stored, too: the file need not be probed on every start. */
+		if (w->info.length > 0.0)
+			set_dvalue (ent, "length", w->info.length);
+		set_ivalue (ent, "width", w->info.width);
+		set_ivalue (ent, "height", w->info.height);
+		set_ivalue (ent, "codec", w->info.codec);
+		set_ivalue (ent, "keyframes", w->info.keyframes);
+
+		/* Filters may use them. An open file is categorized when it is released. */
+		if (!(ent->flags & ENTRY_BUSY))
+			categorize_file_entry (ent);
+	}
+
+	free (w->filename);
+	free (w);
+	media_start ();
+}
+
+/* Read the media properties of ENT in the background, once per key. */
+void media_probe (struct atrfs_entry *ent)
+{
+	struct media_work *w;
+
+	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
+	if (FILE_ENTRY(ent)->probed || ! FILE_ENTRY(ent)->has_key)
+		return;
+	FILE_ENTRY(ent)->probed = true;
+
+	w = calloc (1, sizeof (*w));
+	if (! w)
+		abort ();
+	w->ent = ent;
+	memcpy (w->key, FILE_ENTRY(ent)->key, KEY_SIZE);
+	w->filename = strdup (REAL_NAME(ent));
+
+	if (! pending)
+		pending = g_ptr_array_new ();
+	g_ptr_array_add (pending, w);
+
+	/* Before the main loop runs, the files are only collected. */
+	if (media_queue)
+		media_start ();
+}
+
+/* Called by the scan for every file it adds. */
+void media_prefetch (struct atrfs_entry *ent)
+{
+	if (get_dvalue (ent, "length", 0.0) <= 0.0)
+		media_probe (ent);
+}
+
+/* The value of the integer property ATTR of ENT, or 0 if not known yet. */
+int get_media_ivalue (struct atrfs_entry *ent, char *attr)
+{
+	int value = get_ivalue (ent, attr, 0);
+	if (value <= 0)
+	{
+		media_probe (ent);
+		value = 0;
+	}
+	return value;
+}
+
+/*
+ * Keep the probing threads busy. As in verify.c, only a few items
+ * at a time are given to the work queue, so that the FUSE loop never
+ * blocks on it.
+ */
+void media_start (void)
+{
+	if (! media_queue)
+		media_queue = workqueue_new (MEDIA_THREADS, 2 * MEDIA_THREADS);
+
+	if (! pending)
+		return;
+
+	while (running < 2 * MEDIA_THREADS && next_pending < pending->len)
+	{
+		running++;
+		workqueue_add (media_queue, probe_file, probed,
+			       g_ptr_array_index (pending, next_pending++));
+	}
+
+	if (next_pending == pending->len)
+	{
+		g_ptr_array_free (pending, TRUE);
+		pending = NULL;
+		next_pending = 0;
+	}
+}
+
+int media_fd (void)
+{
+	return workqueue_fd (media_queue);
+}
+
+void handle_media (void)
+{
+	if (media_queue)
+		workqueue_complete (media_queue);
+}
@@ -0,0 +1,12 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+#include "entry.h"
+
+void media_probe (struct atrfs_entry *ent);
+void media_prefetch (struct atrfs_entry *ent);
+int get_media_ivalue (struct atrfs_entry *ent, char *attr);
+void media_start (void);
+int media_fd (void);
+void handle_media (void);
+
+#endif /* MEDIA_H */
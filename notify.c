@@ -1,25 +1,82 @@
 #include <sys/inotify.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "entry.h"
+#include "util.h"
+#include "verify.h"
 
-extern struct pollfd pfd[2];
+extern struct pollfd pfd[];
 static int notify_fd = -1;
 
+/* Watch descriptor -> watched directory */
+static GHashTable *wd_to_dir;
+
+/* The scan adds watches from its walking threads. */
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Real path -> file entry */
+static GHashTable *path_to_entry;
+
 void add_notify(const char *dirname, uint32_t mask)
 {
+	pthread_mutex_lock(&wd_lock);
 	if (notify_fd < 0)
 	{
 		notify_fd = inotify_init1(IN_NONBLOCK);
 		pfd[1].fd = notify_fd;
 		pfd[1].events = POLLIN;
+		wd_to_dir = g_hash_table_new(g_direct_hash, g_direct_equal);
 	}
 
-	inotify_add_watch(notify_fd, dirname, mask);
+	int wd = inotify_add_watch(notify_fd, dirname, mask);
+	if (wd >= 0)
+	{
+		free(g_hash_table_lookup(wd_to_dir, GINT_TO_POINTER(wd)));
+		g_hash_table_replace(wd_to_dir, GINT_TO_POINTER(wd), strdup(dirname));
+	}
+	pthread_mutex_unlock(&wd_lock);
 	tmplog("Watching '%s'\n", dirname);
 }
 
+/* Let changes to the real file of ENT be noticed. */
+void add_notify_entry(struct atrfs_entry *ent)
+{
+	ASSERT_TYPE(ent, ATRFS_FILE_ENTRY);
+	if (!path_to_entry)
+		path_to_entry = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_replace(path_to_entry, REAL_NAME(ent), ent);
+}
+
+void remove_notify_entry(struct atrfs_entry *ent)
+{
+	if (path_to_entry && g_hash_table_lookup(path_to_entry, REAL_NAME(ent)) == ent)
+		g_hash_table_remove(path_to_entry, REAL_NAME(ent));
+}
+
+static struct atrfs_entry *event_entry(struct inotify_event *ie)
+{
+	struct atrfs_entry *ent = NULL;
+	char *dir;
+
+	pthread_mutex_lock(&wd_lock);
+	dir = g_hash_table_lookup(wd_to_dir, GINT_TO_POINTER(ie->wd));
+	if (dir && path_to_entry)
+	{
+		char path[strlen(dir) + strlen(ie->name) + 2];
+		sprintf(path, "%s/%s", dir, ie->name);
+		ent = g_hash_table_lookup(path_to_entry, path);
+	}
+	pthread_mutex_unlock(&wd_lock);
+	return ent;
+}
+
 void handle_notify(void)
 {
-	char ibuf[256]; /* XXX */
+	char ibuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 	int i = 0;
 	int len = read(notify_fd, ibuf, sizeof(ibuf));
 
@@ -64,6 +121,16 @@ void handle_notify(void)
 		if (ie->mask & IN_OPEN)
 			tmplog(", OPEN");
 		tmplog("\n");
+
+		/* A known file got new contents: identify it again. */
+		if (ie->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		{
+			struct atrfs_entry *ent = event_entry(ie);
+			if (ent)
+			{
+				verify_entry(ent, NULL);
+				verify_start();
+			}
+		}
 	}
 }
-
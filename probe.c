@@ -0,0 +1,680 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "probe.h"
+
+/*
+ * The length and other properties of a video from its headers. FLV
+ * files keep them in the onMetaData script tag, WebM (Matroska) files
+ * in the Segment Info and Tracks. Both are near the start of the file,
+ * so only its first PROBE_SIZE bytes are read. Properties that are not
+ * found there are left to mplayer, see media.c.
+ */
+
+#define PROBE_SIZE (16 * 1024)
+
+/* Bytes BUF[POS..END) being parsed */
+struct probe_buf
+{
+	const unsigned char *buf;
+	size_t pos, end;
+};
+
+static bool probe_has (struct probe_buf *pb, size_t n)
+{
+	return pb->pos <= pb->end && n <= pb->end - pb->pos;
+}
+
+static uint64_t get_be (struct probe_buf *pb, int n)
+{
+	uint64_t v = 0;
+	while (n-- > 0)
+		v = (v << 8) | pb->buf[pb->pos++];
+	return v;
+}
+
+static double be_to_double (uint64_t bits)
+{
+	double d;
+	memcpy (&d, &bits, sizeof (d));
+	return d;
+}
+
+/* FLV */
+
+enum
+{
+	AMF_NUMBER = 0, AMF_BOOLEAN = 1, AMF_STRING = 2, AMF_OBJECT = 3,
+	AMF_NULL = 5, AMF_UNDEFINED = 6, AMF_REFERENCE = 7, AMF_ECMA_ARRAY = 8,
+	AMF_OBJECT_END = 9, AMF_STRICT_ARRAY = 10, AMF_DATE = 11,
+	AMF_LONG_STRING = 12,
+};
+
+static bool amf_skip_value (struct probe_buf *pb, int depth);
+
+/*
+ * Go through the name: value pairs of an object, up to and with its
+ * end. FN, if given, may read the value of a pair and return true;
+ * otherwise the value is skipped.
+ */
+static bool amf_props (struct probe_buf *pb, int depth,
+		       bool (*fn)(const unsigned char *name, size_t len))
+{
+	for (;;)
+	{
+		const unsigned char *name;
+		size_t len;
+
+		if (! probe_has (pb, 2))
+			return false;
+		len = get_be (pb, 2);
+		if (len == 0)
+			return probe_has (pb, 1) && pb->buf[pb->pos++] == AMF_OBJECT_END;
+		if (! probe_has (pb, len + 1))
+			return false;
+		name = pb->buf + pb->pos;
+		pb->pos += len;
+		if (fn && fn (name, len))
+			continue;
+		if (! amf_skip_value (pb, depth))
+			return false;
+	}
+}
+
+static bool amf_skip_value (struct probe_buf *pb, int depth)
+{
+	uint64_t n;
+
+	if (depth > 16 || ! probe_has (pb, 1))
+		return false;
+
+	switch (pb->buf[pb->pos++])
+	{
+	case AMF_NUMBER:
+		n = 8;
+		break;
+	case AMF_BOOLEAN:
+		n = 1;
+		break;
+	case AMF_STRING:
+	case AMF_LONG_STRING:
+		{
+			int lenlen = pb->buf[pb->pos - 1] == AMF_STRING ? 2 : 4;
+			if (! probe_has (pb, lenlen))
+				return false;
+			n = get_be (pb, lenlen);
+		}
+		break;
+	case AMF_OBJECT:
+		return amf_props (pb, depth + 1, NULL);
+	case AMF_NULL:
+	case AMF_UNDEFINED:
+		n = 0;
+		break;
+	case AMF_REFERENCE:
+		n = 2;
+		break;
+	case AMF_ECMA_ARRAY:
+		if (! probe_has (pb, 4))
+			return false;
+		pb->pos += 4;
+		return amf_props (pb, depth + 1, NULL);
+	case AMF_STRICT_ARRAY:
+		if (! probe_has (pb, 4))
+			return false;
+		for (n = get_be (pb, 4); n > 0; n--)
+			if (! amf_skip_value (pb, depth + 1))
+				return false;
+		return true;
+	case AMF_DATE:
+		n = 10;
+		break;
+	default:
+		return false;
+	}
+
+	if (! probe_has (pb, n))
+		return false;
+	pb->pos += n;
+	return true;
+}
+
+static bool flv_probe (const unsigned char *buf, size_t size, struct media_info *info)
+{
+	struct probe_buf pb = { buf, 0, size };
+	size_t len;
+
+	/* Read a number, if the value is one. */
+	bool number (double *value)
+	{
+		if (! probe_has (&pb, 9) || buf[pb.pos] != AMF_NUMBER)
+			return false;
+		pb.pos++;
+		*value = be_to_double (get_be (&pb, 8));
+		return true;
+	}
+
+	/* keyframes: { times: [...], filepositions: [...] } */
+	bool keyframe_prop (const unsigned char *name, size_t len)
+	{
+		if (len != 5 || memcmp (name, "times", 5) ||
+		    ! probe_has (&pb, 5) || buf[pb.pos] != AMF_STRICT_ARRAY)
+			return false;
+		info->keyframes = (buf[pb.pos + 1] << 24) | (buf[pb.pos + 2] << 16) |
+			(buf[pb.pos + 3] << 8) | buf[pb.pos + 4];
+		return false;	/* skip the array, too */
+	}
+
+	bool metadata_prop (const unsigned char *name, size_t len)
+	{
+		double value;
+
+#define IS(s) (len == sizeof (s) - 1 && memcmp (name, s, len) == 0)
+		if (IS ("duration") && number (&value))
+			info->length = value;
+		else if (IS ("width") && number (&value))
+			info->width = value;
+		else if (IS ("height") && number (&value))
+			info->height = value;
+		else if (IS ("videocodecid") && number (&value))
+		{
+			switch ((int)value)
+			{
+			case 2: info->codec = CODEC_H263; break;
+			case 4: case 5: info->codec = CODEC_VP6; break;
+			case 7: info->codec = CODEC_H264; break;
+			case 12: info->codec = CODEC_HEVC; break;
+			}
+		} else if (IS ("keyframes") && probe_has (&pb, 1) && buf[pb.pos] == AMF_OBJECT) {
+			pb.pos++;
+			amf_props (&pb, 1, keyframe_prop);
+		} else
+			return false;
+		return true;
+#undef IS
+	}
+
+	/* Header, PreviousTagSize0 and the first tag header */
+	if (! probe_has (&pb, 9) || memcmp (buf, "FLV", 3))
+		return false;
+	pb.pos = 5;
+	pb.pos = get_be (&pb, 4) + 4;
+	if (! probe_has (&pb, 11) || buf[pb.pos] != 18)	/* script data */
+		return false;
+	pb.pos += 1;
+	len = get_be (&pb, 3);
+	pb.pos += 7;
+	if (probe_has (&pb, len))
+		pb.end = pb.pos + len;
+
+	/* "onMetaData", then an object or an ECMA array of properties */
+	if (! probe_has (&pb, 13) || buf[pb.pos] != AMF_STRING ||
+	    memcmp (buf + pb.pos + 1, "\0\nonMetaData", 12))
+		return false;
+	pb.pos += 13;
+	if (! probe_has (&pb, 5))
+		return false;
+	if (buf[pb.pos] == AMF_ECMA_ARRAY)
+		pb.pos += 5;
+	else if (buf[pb.pos] == AMF_OBJECT)
+		pb.pos += 1;
+	else
+		return false;
+
+	/* The file may be cut short in the middle; keep what was found. */
+	amf_props (&pb, 0, metadata_prop);
+	return true;
+}
+
+/* WebM */
+
+#define EBML_HEADER		0x1a45dfa3
+#define EBML_SEGMENT		0x18538067
+#define EBML_INFO		0x1549a966
+#define EBML_TIMECODE_SCALE	0x2ad7b1
+#define EBML_DURATION		0x4489
+#define EBML_TRACKS		0x1654ae6b
+#define EBML_TRACK_ENTRY	0xae
+#define EBML_TRACK_TYPE		0x83
+#define EBML_CODEC_ID		0x86
+#define EBML_VIDEO		0xe0
+#define EBML_PIXEL_WIDTH	0xb0
+#define EBML_PIXEL_HEIGHT	0xba
+#define EBML_CUES		0x1c53bb6b
+#define EBML_CUE_POINT		0xbb
+#define EBML_CLUSTER		0x1f43b675
+#define EBML_UNKNOWN_SIZE	UINT64_MAX
+
+/* A variable length integer; IDs keep their length marker. */
+static bool ebml_vint (struct probe_buf *pb, bool is_id, uint64_t *value)
+{
+	int len, i;
+	uint64_t v;
+	bool all_ones;
+
+	if (! probe_has (pb, 1) || pb->buf[pb->pos] == 0)
+		return false;
+	len = __builtin_clz (pb->buf[pb->pos]) - 23;
+	if (! probe_has (pb, len) || (is_id && len > 4))
+		return false;
+
+	v = pb->buf[pb->pos++];
+	if (! is_id)
+		v &= 0xff >> len;
+	all_ones = v == (0xff >> len);
+	for (i = 1; i < len; i++)
+	{
+		all_ones = all_ones && pb->buf[pb->pos] == 0xff;
+		v = (v << 8) | pb->buf[pb->pos++];
+	}
+	*value = (! is_id && all_ones) ? EBML_UNKNOWN_SIZE : v;
+	return true;
+}
+
+static bool ebml_element (struct probe_buf *pb, uint64_t *id, uint64_t *size)
+{
+	return ebml_vint (pb, true, id) && ebml_vint (pb, false, size);
+}
+
+/*
+ * Call FN for every child of the element at PB of LEN bytes, with
+ * CHILD on its data. The parent is cut to the part that was read.
+ */
+static void ebml_children (struct probe_buf *pb, uint64_t len,
+			   void (*fn)(uint64_t id, struct probe_buf *child, uint64_t len))
+{
+	struct probe_buf p = *pb;
+	uint64_t id, clen;
+
+	if (probe_has (&p, len))
+		p.end = p.pos + len;
+	while (ebml_element (&p, &id, &clen) && probe_has (&p, clen))
+	{
+		struct probe_buf child = p;
+		child.end = p.pos + clen;
+		fn (id, &child, clen);
+		p.pos += clen;
+	}
+}
+
+static uint64_t ebml_uint (struct probe_buf *pb, uint64_t len)
+{
+	return len >= 1 && len <= 8 ? get_be (pb, len) : 0;
+}
+
+static double ebml_float (struct probe_buf *pb, uint64_t len)
+{
+	if (len == 8)
+		return be_to_double (get_be (pb, 8));
+	if (len == 4)
+	{
+		uint32_t bits = get_be (pb, 4);
+		float f;
+		memcpy (&f, &bits, sizeof (f));
+		return f;
+	}
+	return 0.0;
+}
+
+static bool webm_probe (const unsigned char *buf, size_t size, struct media_info *info)
+{
+	struct probe_buf pb = { buf, 0, size };
+	uint64_t id, len, scale = 1000000;	/* ns, the default */
+	double duration = 0.0;
+	bool found = false;
+
+	void info_child (uint64_t id, struct probe_buf *p, uint64_t len)
+	{
+		if (id == EBML_TIMECODE_SCALE)
+			scale = ebml_uint (p, len);
+		else if (id == EBML_DURATION)
+			duration = ebml_float (p, len);
+	}
+
+	/* The first video track */
+	void track_child (uint64_t id, struct probe_buf *p, uint64_t len)
+	{
+		struct media_info track = { 0 };
+		bool is_video = false;
+
+		void video_child (uint64_t id, struct probe_buf *p, uint64_t len)
+		{
+			if (id == EBML_PIXEL_WIDTH)
+				track.width = ebml_uint (p, len);
+			else if (id == EBML_PIXEL_HEIGHT)
+				track.height = ebml_uint (p, len);
+		}
+
+		void entry_child (uint64_t id, struct probe_buf *p, uint64_t len)
+		{
+			if (id == EBML_TRACK_TYPE)
+				is_video = ebml_uint (p, len) == 1;
+			else if (id == EBML_VIDEO)
+				ebml_children (p, len, video_child);
+			else if (id == EBML_CODEC_ID)
+			{
+				const char *codec = (const char *)p->buf + p->pos;
+#define IS(s) (len >= sizeof (s) - 1 && strncmp (codec, s, sizeof (s) - 1) == 0)
+				if (IS ("V_VP8"))
+					track.codec = CODEC_VP8;
+				else if (IS ("V_VP9"))
+					track.codec = CODEC_VP9;
+				else if (IS ("V_AV1"))
+					track.codec = CODEC_AV1;
+				else if (IS ("V_MPEG4/ISO/AVC"))
+					track.codec = CODEC_H264;
+				else if (IS ("V_MPEGH/ISO/HEVC"))
+					track.codec = CODEC_HEVC;
+#undef IS
+			}
+		}
+
+		if (id != EBML_TRACK_ENTRY || info->width)
+			return;
+		ebml_children (p, len, entry_child);
+		if (is_video)
+		{
+			info->width = track.width;
+			info->height = track.height;
+			info->codec = track.codec;
+		}
+	}
+
+	void cue_child (uint64_t id, struct probe_buf *p, uint64_t len)
+	{
+		if (id == EBML_CUE_POINT)
+			info->keyframes++;
+	}
+
+	if (! ebml_element (&pb, &id, &len) || id != EBML_HEADER || ! probe_has (&pb, len))
+		return false;
+	pb.pos += len;
+	if (! ebml_element (&pb, &id, &len) || id != EBML_SEGMENT)
+		return false;
+
+	/* Info and Tracks are among the first children of the Segment. */
+	while (ebml_element (&pb, &id, &len) && id != EBML_CLUSTER &&
+	       len != EBML_UNKNOWN_SIZE && probe_has (&pb, len))
+	{
+		if (id == EBML_INFO)
+			ebml_children (&pb, len, info_child);
+		else if (id == EBML_TRACKS)
+			ebml_children (&pb, len, track_child);
+		else if (id == EBML_CUES)
+			ebml_children (&pb, len, cue_child);
+		pb.pos += len;
+		found = true;
+	}
+
+	info->length = duration * scale / 1e9;
+	return found;
+}
+
+/*
+ * Fill INFO from the headers of FILENAME. Return false if it is not
+ * a video whose headers could be read.
+ */
+bool probe_media (const char *filename, struct media_info *info)
+{
+	unsigned char buf[PROBE_SIZE];
+	bool ret = false;
+	ssize_t len;
+	int fd;
+
+	memset (info, 0, sizeof (*info));
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	len = pread (fd, buf, sizeof (buf), 0);
+	close (fd);
+	if (len <= 0)
+		return false;
+
+	if (len >= 3 && memcmp (buf, "FLV", 3) == 0)
+		ret = flv_probe (buf, len, info);
+	else if (len >= 4 && memcmp (buf, "\x1a\x45\xdf\xa3", 4) == 0)
+		ret = webm_probe (buf, len, info);
+
+	/* NaN and garbage are as good as nothing. */
+	if (! (info->length > 0.0 && info->length < 1e7))
+		info->length = 0.0;
+	if (info->width <= 0 || info->height <= 0 || info->width > 65535 || info->height > 65535)
+		info->width = info->height = 0;
+	if (info->keyframes < 0)
+		info->keyframes = 0;
+	return ret;
+}
+
+const char *codec_name (enum media_codec codec)
+{
+	static const char *names[] = {
+		[CODEC_UNKNOWN] = "unknown",
+		[CODEC_H263] = "h263",
+		[CODEC_VP6] = "vp6",
+		[CODEC_H264] = "h264",
+		[CODEC_HEVC] = "hevc",
+		[CODEC_VP8] = "vp8",
+		[CODEC_VP9] = "vp9",
+		[CODEC_AV1] = "av1",
+	};
+
+	if (codec < 0 || codec >= sizeof (names) / sizeof (names[0]))
+		codec = CODEC_UNKNOWN;
+	return names[codec];
+}
+
+#ifdef PROBE_TEST
+/*
+ * Without arguments, check the parsers with made up headers.
+ * Otherwise print what the headers of every file given tell.
+ */
+static size_t put_be (unsigned char *p, uint64_t v, int n)
+{
+	int i;
+	for (i = n - 1; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xff;
+	return n;
+}
+
+static size_t put_double (unsigned char *p, double d)
+{
+	uint64_t bits;
+	memcpy (&bits, &d, sizeof (bits));
+	return put_be (p, bits, 8);
+}
+
+static size_t put_amf_name (unsigned char *p, const char *name)
+{
+	size_t n = put_be (p, strlen (name), 2);
+	memcpy (p + n, name, strlen (name));
+	return n + strlen (name);
+}
+
+static size_t make_flv (unsigned char *buf, double duration)
+{
+	unsigned char *p = buf, *tag;
+	int i;
+
+	memcpy (p, "FLV\x01\x05", 5);
+	p += 5;
+	p += put_be (p, 9, 4);
+	p += put_be (p, 0, 4);
+
+	tag = p;
+	p += 11;
+	*p++ = AMF_STRING;
+	p += put_amf_name (p, "onMetaData");
+	*p++ = AMF_ECMA_ARRAY;
+	p += put_be (p, 7, 4);
+
+	/* Something to skip before the duration */
+	p += put_amf_name (p, "encoder");
+	*p++ = AMF_STRING;
+	p += put_amf_name (p, "Lavf");
+	p += put_amf_name (p, "keyframes");
+	*p++ = AMF_OBJECT;
+	p += put_amf_name (p, "times");
+	*p++ = AMF_STRICT_ARRAY;
+	p += put_be (p, 50, 4);
+	for (i = 0; i < 50; i++)
+	{
+		*p++ = AMF_NUMBER;
+		p += put_double (p, i * 2.0);
+	}
+	p += put_be (p, 0, 2);
+	*p++ = AMF_OBJECT_END;
+	p += put_amf_name (p, "hasVideo");
+	*p++ = AMF_BOOLEAN;
+	*p++ = 1;
+
+	p += put_amf_name (p, "width");
+	*p++ = AMF_NUMBER;
+	p += put_double (p, 640);
+	p += put_amf_name (p, "height");
+	*p++ = AMF_NUMBER;
+	p += put_double (p, 360);
+	p += put_amf_name (p, "videocodecid");
+	*p++ = AMF_NUMBER;
+	p += put_double (p, 7);
+	p += put_amf_name (p, "duration");
+	*p++ = AMF_NUMBER;
+	p += put_double (p, duration);
+	p += put_be (p, 0, 2);
+	*p++ = AMF_OBJECT_END;
+
+	tag[0] = 18;
+	put_be (tag + 1, p - tag - 11, 3);
+	memset (tag + 4, 0, 7);
+	return p - buf;
+}
+
+static size_t put_element (unsigned char *p, uint32_t id, const unsigned char *data, size_t len)
+{
+	size_t n = 0;
+	int idlen = id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1;
+
+	n += put_be (p, id, idlen);
+	n += put_be (p + n, 0x0100000000000000ULL | len, 8);	/* 8 byte size */
+	memcpy (p + n, data, len);
+	return n + len;
+}
+
+static size_t make_webm (unsigned char *buf, double duration, bool as_float)
+{
+	unsigned char info[64], hdr[16], *p = buf, *q = info;
+	unsigned char tracks[256], track[128], video[64], *t, *v;
+	unsigned char num[8];
+
+	p += put_element (p, EBML_HEADER, (unsigned char *)"\x42\x82\x84webm", 7);
+	p += put_be (p, EBML_SEGMENT, 4);
+	*p++ = 0x01;
+	p += put_be (p, 0x00ffffffffffffffULL, 7);	/* unknown size */
+	p += put_element (p, 0xec, (unsigned char *)"\0\0\0\0", 4);	/* Void */
+
+	put_be (num, 500000, 3);
+	q += put_element (q, EBML_TIMECODE_SCALE, num, 3);
+	if (as_float)
+	{
+		float f = duration * 2000;
+		uint32_t bits;
+		memcpy (&bits, &f, sizeof (bits));
+		put_be (num, bits, 4);
+		q += put_element (q, EBML_DURATION, num, 4);
+	} else {
+		put_double (num, duration * 2000);
+		q += put_element (q, EBML_DURATION, num, 8);
+	}
+	p += put_element (p, EBML_INFO, info, q - info);
+
+	/* An audio track, then a video track */
+	q = tracks;
+	t = track;
+	t += put_element (t, EBML_TRACK_TYPE, (unsigned char *)"\x02", 1);
+	t += put_element (t, EBML_CODEC_ID, (unsigned char *)"A_OPUS", 6);
+	q += put_element (q, EBML_TRACK_ENTRY, track, t - track);
+	t = track;
+	v = video;
+	v += put_element (v, EBML_PIXEL_WIDTH, (unsigned char *)"\x05\x00", 2);
+	v += put_element (v, EBML_PIXEL_HEIGHT, (unsigned char *)"\x02\xd0", 2);
+	t += put_element (t, EBML_TRACK_TYPE, (unsigned char *)"\x01", 1);
+	t += put_element (t, EBML_CODEC_ID, (unsigned char *)"V_VP9", 5);
+	t += put_element (t, EBML_VIDEO, video, v - video);
+	q += put_element (q, EBML_TRACK_ENTRY, track, t - track);
+	p += put_element (p, EBML_TRACKS, tracks, q - tracks);
+
+	memset (hdr, 0, sizeof (hdr));
+	p += put_element (p, EBML_CLUSTER, hdr, sizeof (hdr));
+	return p - buf;
+}
+
+static void print_info (const char *what, struct media_info *info)
+{
+	printf ("%-24s %9.3f %5dx%-5d %-7s %4d", what, info->length,
+		info->width, info->height, codec_name (info->codec), info->keyframes);
+}
+
+static int check (const char *what, const unsigned char *buf, size_t len,
+		  double length, int width, int height, enum media_codec codec, int keyframes)
+{
+	char name[] = "/tmp/probeXXXXXX";
+	int fd = mkstemp (name);
+	struct media_info info;
+	bool ok;
+
+	if (fd < 0 || write (fd, buf, len) != len)
+	{
+		perror (name);
+		return 1;
+	}
+	close (fd);
+	probe_media (name, &info);
+	unlink (name);
+
+	ok = (info.length > length ? info.length - length : length - info.length) < 1e-3 &&
+		info.width == width && info.height == height &&
+		info.codec == codec && info.keyframes == keyframes;
+	print_info (what, &info);
+	printf (" %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main (int argc, char *argv[])
+{
+	static unsigned char buf[2 * PROBE_SIZE];
+	struct media_info info;
+	int i, failed = 0;
+	size_t len;
+
+	if (argc > 1)
+	{
+		for (i = 1; i < argc; i++)
+		{
+			probe_media (argv[i], &info);
+			print_info (argv[i], &info);
+			printf ("\n");
+		}
+		return 0;
+	}
+
+	len = make_flv (buf, 1234.5);
+	failed += check ("flv", buf, len, 1234.5, 640, 360, CODEC_H264, 50);
+	failed += check ("flv, cut short", buf, len - 20, 0.0, 640, 360, CODEC_H264, 50);
+	buf[13] = 9;	/* a video tag first */
+	failed += check ("flv, no metadata", buf, len, 0.0, 0, 0, CODEC_UNKNOWN, 0);
+
+	len = make_webm (buf, 61.25, false);
+	failed += check ("webm", buf, len, 61.25, 1280, 720, CODEC_VP9, 0);
+	len = make_webm (buf, 61.25, true);
+	failed += check ("webm, float duration", buf, len, 61.25, 1280, 720, CODEC_VP9, 0);
+	failed += check ("webm, header only", buf, 40, 0.0, 0, 0, CODEC_UNKNOWN, 0);
+
+	memset (buf, 0, sizeof (buf));
+	failed += check ("zeros", buf, sizeof (buf), 0.0, 0, 0, CODEC_UNKNOWN, 0);
+
+	return failed != 0;
+}
+#endif /* PROBE_TEST */
@@ -0,0 +1,30 @@
+#ifndef PROBE_H
+#define PROBE_H
+#include <stdbool.h>
+
+/* Video codecs, as stored in the codec column */
+enum media_codec
+{
+	CODEC_UNKNOWN,
+	CODEC_H263,
+	CODEC_VP6,
+	CODEC_H264,
+	CODEC_HEVC,
+	CODEC_VP8,
+	CODEC_VP9,
+	CODEC_AV1,
+};
+
+/* What the headers of a video tell; zero when they don't. */
+struct media_info
+{
+	double length;		/* seconds */
+	int width, height;
+	enum media_codec codec;
+	int keyframes;
+};
+
+bool probe_media (const char *filename, struct media_info *info);
+const char *codec_name (enum media_codec codec);
+
+#endif /* PROBE_H */
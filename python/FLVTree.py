@@ -56,7 +56,7 @@ class FLVDatabase():
 	def get_attr(self, sha1, attr, default=None):
 		conn = sqlite3.connect(self.filename)
 		curs = conn.cursor()
-		curs.execute("SELECT %s FROM Files WHERE sha1 = \"%s\"" % (attr, sha1))
+		curs.execute("SELECT %s FROM Files WHERE sha1 = x'%s'" % (attr, sha1))
 		for line in curs:
 			curs.close()
 			conn.close()
@@ -68,7 +68,7 @@ class FLVDatabase():
 	def set_attr(self, sha1, attr, value):
 		conn = sqlite3.connect(self.filename)
 		curs = conn.cursor()
-		curs.execute("UPDATE Files SET %s = \"%s\" WHERE sha1 = \"%s\"" % (attr, value, sha1))
+		curs.execute("UPDATE Files SET %s = \"%s\" WHERE sha1 = x'%s'" % (attr, value, sha1))
 		conn.commit()
 		curs.close()
 		conn.close()
@@ -1,45 +1,261 @@
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sha1.h"
 
-char *get_sha1(char *filename)
+/*
+ * Files are read in large aligned chunks: with the old 1 KiB reads
+ * hashing a multi-GB video was bound by syscalls, not by the disk.
+ */
+#define SHA1_CHUNK (1024 * 1024)
+
+/* Size of each of the head, middle and tail samples of a fingerprint. */
+#define FINGERPRINT_SAMPLE (64 * 1024)
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* HEX must have room for 2*KEY_SIZE + 1 characters. */
+char *key_to_hex(const unsigned char *key, char *hex)
 {
-	SHA_CTX context;
+	int i;
+	for (i = 0; i < KEY_SIZE; i++)
+	{
+		hex[2*i] = hexdigits[key[i] >> 4];
+		hex[2*i + 1] = hexdigits[key[i] & 0xf];
+	}
+	hex[2*KEY_SIZE] = '\0';
+	return hex;
+}
 
-	unsigned char buf[SHA_DIGEST_LENGTH] = {0};
-	static unsigned char ret[2*SHA_DIGEST_LENGTH + 1];
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool hex_to_key(const char *hex, unsigned char *key)
+{
 	int i;
+	for (i = 0; i < KEY_SIZE; i++)
+	{
+		int hi = hexval(hex[2*i]);
+		int lo = hi < 0 ? -1 : hexval(hex[2*i + 1]);
+		if (lo < 0)
+			return false;
+		key[i] = hi << 4 | lo;
+	}
+	return hex[2*KEY_SIZE] == '\0';
+}
+
+static bool sha1_fd(int fd, unsigned char *digest)
+{
+	EVP_MD_CTX *ctx;
+	unsigned char *buf;
+	off_t done = 0;
+	bool ok = false;
+
+	if (posix_memalign((void **)&buf, 4096, SHA1_CHUNK))
+		return false;
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL))
+		goto out;
+
+	/* We read everything once: tell the kernel to read ahead. */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (;;)
+	{
+		ssize_t len = read(fd, buf, SHA1_CHUNK);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		if (len == 0)
+			break;
+
+		EVP_DigestUpdate(ctx, buf, len);
+
+		/* Don't let the hashed data push everything else out of the page cache. */
+		posix_fadvise(fd, done, len, POSIX_FADV_DONTNEED);
+		done += len;
+	}
+
+	ok = EVP_DigestFinal_ex(ctx, digest, NULL);
+out:
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return ok;
+}
+
+/*
+ * Store the SHA1 of FILENAME into KEY (KEY_SIZE bytes). Return
+ * NULL if the file can't be read: KEY is then zero, and must not
+ * be used as the key of the file.
+ */
+unsigned char *get_sha1_r(char *filename, unsigned char *key)
+{
+	bool ok = false;
 	int fd;
+
+	memset(key, 0, KEY_SIZE);
 	fd = open(filename, O_RDONLY);
 	if (fd >= 0)
 	{
-		unsigned char buf2[1024];
-		int len;
-		SHA1_Init(&context);
+		ok = sha1_fd(fd, key);
+		if (!ok)
+			memset(key, 0, KEY_SIZE);
+		close(fd);
+	}
+	return ok ? key : NULL;
+}
 
-		while ((len = read(fd, buf2, sizeof(buf2))) == sizeof(buf2))
-			SHA1_Update(&context, buf2, sizeof(buf2));
+/*
+ * A quick stand-in for the SHA1 of a whole file: the SHA1 of
+ * the file size and of samples taken from its head, middle and
+ * tail. This reads at most 192 KiB however big the file is.
+ * Return NULL if the file can't be read, as get_sha1_r() does.
+ */
+unsigned char *get_fingerprint_r(char *filename, unsigned char *key)
+{
+	unsigned char *sample;
+	struct stat st;
+	EVP_MD_CTX *ctx;
+	bool ok = false;
+	int fd;
+
+	memset(key, 0, KEY_SIZE);
+	fd = open(filename, O_RDONLY);
+	sample = malloc(FINGERPRINT_SAMPLE);
+	ctx = EVP_MD_CTX_new();
+	if (fd >= 0 && sample && ctx && fstat(fd, &st) == 0 &&
+	    EVP_DigestInit_ex(ctx, EVP_sha1(), NULL))
+	{
+		uint64_t size = st.st_size;
+		off_t offsets[3] = {
+			0,
+			(size - FINGERPRINT_SAMPLE) / 2,
+			size - FINGERPRINT_SAMPLE
+		};
+		int i;
 
-		if (len)
-			SHA1_Update(&context, buf2, len);
+		/* Small files are hashed completely. */
+		if (size <= 3 * FINGERPRINT_SAMPLE)
+		{
+			offsets[1] = FINGERPRINT_SAMPLE;
+			offsets[2] = 2 * FINGERPRINT_SAMPLE;
+		}
 
-		SHA1_Final(buf, &context);
-		close(fd);
+		EVP_DigestUpdate(ctx, &size, sizeof(size));
+		ok = true;
+		for (i = 0; i < 3; i++)
+		{
+			ssize_t len = pread(fd, sample, FINGERPRINT_SAMPLE, offsets[i]);
+			if (len < 0)
+				ok = false;
+			else if (len > 0)
+				EVP_DigestUpdate(ctx, sample, len);
+		}
+		ok = EVP_DigestFinal_ex(ctx, key, NULL) && ok;
+		if (!ok)
+			memset(key, 0, KEY_SIZE);
 	}
 
-out:
-	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
-		sprintf(&ret[2*i], "%2.2x", buf[i]);
-	ret[2*SHA_DIGEST_LENGTH] = '\0';
-	return ret;
+	EVP_MD_CTX_free(ctx);
+	free(sample);
+	if (fd >= 0)
+		close(fd);
+	return ok ? key : NULL;
+}
+
+/* The SHA1 of FILENAME in hex, in HEX of 2*KEY_SIZE + 1 chars, or NULL. */
+char *get_sha1(char *filename, char *hex)
+{
+	unsigned char key[KEY_SIZE];
+	if (!get_sha1_r(filename, key))
+		return NULL;
+	return key_to_hex(key, hex);
 }
 
 #ifdef SHA1_TEST
 int main(int argc, char *argv[])
 {
+	unsigned char fp[KEY_SIZE];
+	char sha1[2*KEY_SIZE + 1], hex[2*KEY_SIZE + 1];
 	int i;
 	for (i = 1; i < argc; i++)
-		printf("%s\n", get_sha1(argv[i]));
+	{
+		if (!get_sha1(argv[i], sha1) || !get_fingerprint_r(argv[i], fp))
+		{
+			perror(argv[i]);
+			continue;
+		}
+		printf("%s %s\n", sha1, key_to_hex(fp, hex));
+	}
 	return 0;
 }
 #endif /* SHA1_TEST */
+
+#ifdef SHA1_BENCH
+#include <sys/stat.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	double total_bytes = 0.0, total_secs = 0.0;
+	char hex[2*KEY_SIZE + 1];
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		struct stat st;
+		if (stat(argv[i], &st) < 0)
+		{
+			perror(argv[i]);
+			continue;
+		}
+
+		double start = now();
+		char *sha1 = get_sha1(argv[i], hex);
+		double secs = now() - start;
+
+		if (!sha1)
+		{
+			perror(argv[i]);
+			continue;
+		}
+
+		printf("%s  %s  %.1f MB/s\n", sha1, argv[i],
+			st.st_size / 1e6 / (secs > 0.0 ? secs : 1e-9));
+		total_bytes += st.st_size;
+		total_secs += secs;
+	}
+
+	if (total_secs > 0.0)
+		printf("total: %.1f MB in %.2f s, %.1f MB/s\n",
+			total_bytes / 1e6, total_secs, total_bytes / 1e6 / total_secs);
+	return 0;
+}
+#endif /* SHA1_BENCH */
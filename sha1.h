@@ -0,0 +1,15 @@
+#ifndef SHA1_H
+#define SHA1_H
+#include <stdbool.h>
+
+/* Files are identified by a binary SHA1 (or fingerprint) of this size. */
+#define KEY_SIZE 20
+
+unsigned char *get_sha1_r (char *filename, unsigned char *key);
+unsigned char *get_fingerprint_r (char *filename, unsigned char *key);
+char *get_sha1 (char *filename, char *hex);
+
+char *key_to_hex (const unsigned char *key, char *hex);
+bool hex_to_key (const char *hex, unsigned char *key);
+
+#endif /* SHA1_H */
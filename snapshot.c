@@ -0,0 +1,311 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "entry.h"
+#include "snapshot.h"
+#include "util.h"
+#include "workqueue.h"
+
+/*
+ * The built tree is saved on exit and every SNAPSHOT_INTERVAL
+ * seconds, so that the next start can mount it at once instead of
+ * scanning, hashing and categorizing every file again. The scan is
+ * then done in the background and only files whose stamp no longer
+ * matches the snapshot are identified again.
+ *
+ * The file is a header, an array of records and the strings the
+ * records point to. It is mapped into memory as a whole when it is
+ * loaded. A snapshot is used only if atrfs.conf still has the stamp
+ * it had when the snapshot was saved.
+ */
+
+#define SNAPSHOT_MAGIC "ATRFSSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INTERVAL (10 * 60)
+
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nfiles;
+	uint64_t strings_size;
+	struct file_stamp config;
+	uint32_t reserved[8];
+};
+
+enum
+{
+	SNAPSHOT_HAS_CONF	= (1<<0),
+	SNAPSHOT_PROVISIONAL	= (1<<1),
+};
+
+struct snapshot_record
+{
+	struct file_stamp stamp;
+	unsigned char key[KEY_SIZE];
+	uint32_t flags;
+	uint32_t path;		/* offsets into the strings */
+	uint32_t name;
+	uint32_t category;
+};
+
+static char *snapshot_name;
+static char *config_name;
+static time_t next_save;
+
+/*
+ * Use FILENAME as the snapshot of the tree built from CONFIG.
+ * An empty FILENAME disables snapshots.
+ */
+void snapshot_open (char *filename, char *config)
+{
+	free (snapshot_name);
+	free (config_name);
+	snapshot_name = NULL;
+	config_name = config ? strdup (config) : NULL;
+
+	if (! *filename || ! config)
+		return;
+
+	/* We chdir to the mount point later, so remember the full path. */
+	if (filename[0] == '/')
+	{
+		snapshot_name = strdup (filename);
+	} else {
+		char *pwd = get_current_dir_name ();
+		asprintf (&snapshot_name, "%s/%s", pwd, filename);
+		free (pwd);
+	}
+	next_save = time (NULL) + SNAPSHOT_INTERVAL;
+}
+
+static bool valid_string (char *strings, uint64_t size, uint32_t offset)
+{
+	return offset < size && memchr (strings + offset, '\0', size - offset);
+}
+
+/*
+ * Call FN for every file of the snapshot. Return false if there is
+ * no usable snapshot; FN has not been called then.
+ */
+bool snapshot_load (void (*fn)(struct snapshot_file *sf))
+{
+	struct snapshot_header *hdr;
+	struct snapshot_record *rec;
+	struct file_stamp config;
+	struct stat st;
+	char *strings;
+	bool ret = false;
+	uint32_t i;
+	int fd;
+
+	if (! snapshot_name || ! get_file_stamp (config_name, &config))
+		return false;
+
+	fd = open (snapshot_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat (fd, &st) < 0 || st.st_size < sizeof (*hdr))
+		goto out;
+
+	hdr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out;
+
+	rec = (struct snapshot_record *)(hdr + 1);
+	strings = (char *)(rec + hdr->nfiles);
+
+	if (memcmp (hdr->magic, SNAPSHOT_MAGIC, 8) || hdr->version != SNAPSHOT_VERSION ||
+	    st.st_size != sizeof (*hdr) + (uint64_t)hdr->nfiles * sizeof (*rec) + hdr->strings_size)
+	{
+		tmplog ("Ignoring invalid snapshot %s\n", snapshot_name);
+		goto unmap;
+	}
+	if (memcmp (&hdr->config, &config, sizeof (config)))
+	{
+		tmplog ("Ignoring snapshot %s of an older %s\n", snapshot_name, config_name);
+		goto unmap;
+	}
+
+	for (i = 0; i < hdr->nfiles; i++)
+	{
+		if (! valid_string (strings, hdr->strings_size, rec[i].path) ||
+		    ! valid_string (strings, hdr->strings_size, rec[i].name) ||
+		    ! valid_string (strings, hdr->strings_size, rec[i].category))
+		{
+			tmplog ("Ignoring corrupted snapshot %s\n", snapshot_name);
+			goto unmap;
+		}
+	}
+
+	for (i = 0; i < hdr->nfiles; i++)
+	{
+		struct snapshot_file sf;
+		sf.stamp = rec[i].stamp;
+		memcpy (sf.key, rec[i].key, KEY_SIZE);
+		sf.path = strings + rec[i].path;
+		sf.name = strings + rec[i].name;
+		sf.category = strings + rec[i].category;
+		sf.has_conf = (rec[i].flags & SNAPSHOT_HAS_CONF) != 0;
+		sf.provisional = (rec[i].flags & SNAPSHOT_PROVISIONAL) != 0;
+		fn (&sf);
+	}
+	tmplog ("Restored %u files from %s\n", hdr->nfiles, snapshot_name);
+	ret = true;
+unmap:
+	munmap (hdr, st.st_size);
+out:
+	close (fd);
+	return ret;
+}
+
+/* The file entries of the tree, as they will be written */
+struct snapshot_data
+{
+	struct snapshot_header hdr;
+	struct snapshot_record *recs;
+	char *strings;
+};
+
+/* The periodic snapshots are written by a thread of their own. */
+static struct workqueue *save_queue;
+
+/*
+ * Collect every file entry of the tree. This only walks the tree,
+ * so that the caller holding tree_lock doesn't wait for the disk.
+ */
+static struct snapshot_data *build_snapshot (void)
+{
+	struct snapshot_data *data;
+	size_t nrecs = 0, nalloc = 0;
+	size_t strings_size;
+	FILE *sfp;
+
+	int add_file (struct atrfs_entry *ent)
+	{
+		struct snapshot_record *rec;
+
+		if (ent->e_type != ATRFS_FILE_ENTRY || ! FILE_ENTRY(ent)->has_key)
+			return 0;
+
+		if (nrecs == nalloc)
+		{
+			nalloc = nalloc ? 2 * nalloc : 1024;
+			data->recs = realloc (data->recs, nalloc * sizeof (*data->recs));
+			if (! data->recs)
+				abort ();
+		}
+		rec = &data->recs[nrecs++];
+		memset (rec, 0, sizeof (*rec));
+		rec->stamp = FILE_ENTRY(ent)->stamp;
+		memcpy (rec->key, FILE_ENTRY(ent)->key, KEY_SIZE);
+
+		char cfgname[strlen (ent->name) + 6];
+		sprintf (cfgname, "%s.conf", ent->name);
+		if (lookup_entry_by_name (ent->parent, cfgname))
+			rec->flags |= SNAPSHOT_HAS_CONF;
+		if (FILE_ENTRY(ent)->provisional)
+			rec->flags |= SNAPSHOT_PROVISIONAL;
+
+		rec->path = ftell (sfp);
+		fputs (REAL_NAME(ent), sfp);
+		fputc ('\0', sfp);
+		rec->name = ftell (sfp);
+		fputs (ent->name, sfp);
+		fputc ('\0', sfp);
+		rec->category = ftell (sfp);
+		fputs (ent->parent == root ? "" : ent->parent->name, sfp);
+		fputc ('\0', sfp);
+		return 0;
+	}
+
+	data = calloc (1, sizeof (*data));
+	if (! data)
+		abort ();
+
+	sfp = open_memstream (&data->strings, &strings_size);
+	map_leaf_entries (root, add_file);
+	fclose (sfp);
+
+	memcpy (data->hdr.magic, SNAPSHOT_MAGIC, 8);
+	data->hdr.version = SNAPSHOT_VERSION;
+	data->hdr.nfiles = nrecs;
+	data->hdr.strings_size = strings_size;
+	return data;
+}
+
+/* Write the snapshot DATA and free it. */
+static void write_snapshot (void *arg)
+{
+	struct snapshot_data *data = arg;
+	struct snapshot_header *hdr = &data->hdr;
+	char *tmpname = NULL;
+	FILE *fp;
+	bool ok;
+
+	if (! get_file_stamp (config_name, &hdr->config))
+		goto out;
+
+	asprintf (&tmpname, "%s.tmp", snapshot_name);
+	fp = fopen (tmpname, "w");
+	ok = fp &&
+		fwrite (hdr, sizeof (*hdr), 1, fp) == 1 &&
+		fwrite (data->recs, sizeof (*data->recs), hdr->nfiles, fp) == hdr->nfiles &&
+		fwrite (data->strings, 1, hdr->strings_size, fp) == hdr->strings_size;
+	if (fp && fclose (fp) != 0)
+		ok = false;
+	if (ok && rename (tmpname, snapshot_name) < 0)
+		ok = false;
+
+	if (ok)
+	{
+		tmplog ("Saved %u files to %s\n", hdr->nfiles, snapshot_name);
+	} else {
+		tmplog ("Can't save snapshot %s\n", tmpname);
+		unlink (tmpname);
+	}
+	free (tmpname);
+out:
+	free (data->strings);
+	free (data->recs);
+	free (data);
+}
+
+/* Save every file entry of the tree now, unless snapshots are disabled. */
+void snapshot_save (void)
+{
+	if (! snapshot_name)
+		return;
+	next_save = time (NULL) + SNAPSHOT_INTERVAL;
+
+	/* A periodic snapshot still being written would replace this one. */
+	if (save_queue)
+	{
+		workqueue_wait (save_queue);
+		workqueue_destroy (save_queue);
+		save_queue = NULL;
+	}
+	write_snapshot (build_snapshot ());
+}
+
+/*
+ * Called from the main loop: save the tree now and then. The tree is
+ * copied here and written in the background.
+ */
+void snapshot_tick (void)
+{
+	if (! snapshot_name || time (NULL) < next_save)
+		return;
+	next_save = time (NULL) + SNAPSHOT_INTERVAL;
+
+	/* Created here, after fuse_daemonize() has forked. */
+	if (! save_queue)
+		save_queue = workqueue_new (1, 1);
+	workqueue_add (save_queue, write_snapshot, NULL, build_snapshot ());
+}
@@ -0,0 +1,23 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdbool.h>
+#include "entry.h"
+
+/* A file entry as it was when the snapshot was saved */
+struct snapshot_file
+{
+	struct file_stamp stamp;
+	unsigned char key[KEY_SIZE];
+	char *path;
+	char *name;
+	char *category;		/* "" for the root directory */
+	bool has_conf;		/* name.conf is next to it */
+	bool provisional;	/* key is a fingerprint, see verify.c */
+};
+
+void snapshot_open (char *filename, char *config);
+bool snapshot_load (void (*fn)(struct snapshot_file *sf));
+void snapshot_save (void);
+void snapshot_tick (void);
+
+#endif /* SNAPSHOT_H */
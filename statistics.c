@@ -11,9 +11,15 @@
 #include "atrfs_ops.h"
 #include "entry.h"
 #include "entry_filter.h"
+#include "entrydb.h"
 #include "util.h"
 
 extern char *language_list;
+extern GHashTable *sha1_to_entry_map;
+
+/* In main.c */
+extern bool get_scan_progress (int *found, int *added, double *seconds, bool *running);
+
 unsigned int stat_count = 20;
 #define RECENT_COUNT 10
 
@@ -54,38 +60,41 @@ void update_recent_file (struct atrfs_entry *ent)
 	VIRTUAL_ENTRY(recent)->set_contents(recent, buf, size);
 }
 
+static void print_stat_line (FILE *fp, char *value, struct atrfs_entry *ent)
+{
+	fprintf (fp, "%s\t%s%c%s\n", value,
+		 ent->parent == root ? "" : ent->parent->name,
+		 ent->parent == root ? '\0' : '/', ent->name);
+}
+
 void update_stats (void)
 {
 	struct atrfs_entry *st_ents[2];
 	st_ents[0] = lookup_entry_by_name(statroot, "top-list");
 	st_ents[1] = lookup_entry_by_name(statroot, "last-list");
 
-	struct atrfs_entry **entries;
+	/* No list can be longer than there are files. */
+	size_t k = g_hash_table_size (sha1_to_entry_map);
+	if (stat_count < k)
+		k = stat_count;
+
+	struct atrfs_entry **entries = malloc ((k + 1) * sizeof (*entries));
+	if (! entries)
+		abort ();
 	size_t count;
 	int i, j;
 
-	/* This gives a list of sorted entries. */
-	get_all_file_entries (&entries, &count);
-
 	for (j = 0; j < 2; j++)
 	{
 		char *stbuf = NULL;
+		char timestr[TIMESTR_SIZE];
 		size_t stsize;
 		FILE *stfp = open_memstream(&stbuf, &stsize);
 
-		for (i = 0; i < stat_count && entries[i]; i++)
-		{
-			struct atrfs_entry *ent;
-			if (j == 0)
-				ent = entries[i];
-			else
-				ent = entries[count - 1 - i];
-
-			double val = get_watchtime(ent);
-			fprintf (stfp, "%s\t%s%c%s\n", secs_to_timestr (val),
-				 ent->parent == root ? "" : ent->parent->name,
-				 ent->parent == root ? '\0' : '/', ent->name);
-		}
+		/* The ranking gives the most or the least watched directly. */
+		count = get_ranked_entries (entries, k, j == 1);
+		for (i = 0; i < count; i++)
+			print_stat_line (stfp, secs_to_timestr (get_watchtime (entries[i]), timestr), entries[i]);
 
 		fclose (stfp);
 		free (VIRTUAL_ENTRY(st_ents[j])->m_data);
@@ -94,6 +103,38 @@ void update_stats (void)
 
 	free (entries);
 
+	struct atrfs_entry *countlist;
+	countlist = lookup_entry_by_name(statroot, "count-list");
+	if (countlist)
+	{
+		struct file_row **top = malloc ((k + 1) * sizeof (*top));
+		char *buf = NULL;
+		size_t size;
+		FILE *fp;
+
+		bool has_entry (struct file_row *row)
+		{
+			return g_hash_table_lookup (sha1_to_entry_map, row->key) != NULL;
+		}
+
+		if (! top)
+			abort ();
+
+		/* Play counts are not ranked, so pick the largest with a heap. */
+		fp = open_memstream (&buf, &size);
+		count = entrydb_top_rows ("count", k, false, has_entry, top);
+		for (i = 0; i < count; i++)
+		{
+			char num[16];
+			sprintf (num, "%d", top[i]->count);
+			print_stat_line (fp, num, g_hash_table_lookup (sha1_to_entry_map, top[i]->key));
+		}
+		fclose (fp);
+		free (top);
+		free (VIRTUAL_ENTRY(countlist)->m_data);
+		VIRTUAL_ENTRY(countlist)->set_contents(countlist, buf, size);
+	}
+
 	struct atrfs_entry *lang;
 	lang = lookup_entry_by_name(statroot, "language");
 	if (lang)
@@ -107,13 +148,51 @@ void update_stats (void)
 		sprintf(buf, "%d\n", stat_count);
 		VIRTUAL_ENTRY(statcount)->set_contents(statcount, buf, strlen(buf));
 	}
+
+	struct atrfs_entry *scan;
+	scan = lookup_entry_by_name(statroot, "scan");
+	if (scan)
+	{
+		int found, added;
+		double seconds;
+		bool running;
+		char *buf = NULL;
+		size_t size;
+		FILE *fp = open_memstream (&buf, &size);
+
+		if (get_scan_progress (&found, &added, &seconds, &running))
+			fprintf (fp, "%s\nfound\t%d\nadded\t%d\nseconds\t%.1f\n",
+				 running ? "scanning" : "done", found, added, seconds);
+		else
+			fprintf (fp, "done\n");
+		fclose (fp);
+		free (VIRTUAL_ENTRY(scan)->m_data);
+		VIRTUAL_ENTRY(scan)->set_contents(scan, buf, size);
+	}
+
+	struct atrfs_entry *filt;
+	filt = lookup_entry_by_name(statroot, "filters");
+	if (filt)
+	{
+		unsigned long evaluated, saved;
+		char *buf = NULL;
+		size_t size;
+		FILE *fp = open_memstream (&buf, &size);
+
+		get_filter_stats (&evaluated, &saved);
+		fprintf (fp, "evaluated\t%lu\nsaved\t%lu\n", evaluated, saved);
+		fclose (fp);
+		free (VIRTUAL_ENTRY(filt)->m_data);
+		VIRTUAL_ENTRY(filt)->set_contents(filt, buf, size);
+	}
 }
 
-void categorize_file_entry (struct atrfs_entry *ent)
+/*
+ * Show the file-specific configuration of ENT as name.conf next to
+ * it. Return that entry, or NULL if ENT has no configuration.
+ */
+struct atrfs_entry *add_file_config (struct atrfs_entry *ent)
 {
-	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
-
-	/* Handle file-specific configuration. */
 	struct atrfs_entry *conf = NULL;
 	int size = getxattr(REAL_NAME(ent), "user.mpconf", NULL, 0);
 	if (size > 0)
@@ -134,6 +213,19 @@ void categorize_file_entry (struct atrfs_entry *ent)
 			attach_entry (ent->parent, conf, cfgname);
 		}
 	}
+	return conf;
+}
+
+void categorize_file_entry (struct atrfs_entry *ent)
+{
+	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
+
+	/* No filter reads what has changed, so the entry stays put. */
+	if (! category_may_change (ent))
+		return;
+
+	/* Handle file-specific configuration. */
+	struct atrfs_entry *conf = add_file_config (ent);
 
 	char *dirname = get_category (ent);
 	struct atrfs_entry *dir = lookup_entry_by_name (root, dirname);
@@ -83,7 +83,10 @@ void detach_subtitles (struct atrfs_entry *ent)
 		tmp = VIRTUAL_ENTRY(srt)->next;
 		detach_entry (srt);
 		free (VIRTUAL_ENTRY(srt)->m_data);
-		destroy_entry (srt);
+		VIRTUAL_ENTRY(srt)->set_contents (srt, NULL, 0);
+
+		/* The kernel may still know the inode, so the entry is kept. */
+		srt->flags |= ENTRY_DELETED;
 		srt = tmp;
 	}
 
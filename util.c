@@ -1,17 +1,20 @@
 /* util.c - 24.7.2008 - 1.11.2008 Ari & Tero Roponen */
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <attr/xattr.h>
 #include "entry.h"
 #include "entrydb.h"
+#include "inval.h"
 #include "util.h"
 
-char *get_sha1 (char *filename);
+char *get_sha1 (char *filename, char *hex);
 
 double doubletime(void)
 {
@@ -25,45 +28,10 @@ double doubletime(void)
 	return ret;
 }
 
-static bool get_value_internal (struct atrfs_entry *ent, char *attr, int count, char *fmt, ...)
-{
-	char *val = entrydb_get (ent, attr);
-	if (val)
-	{
-		va_list list;
-		va_start (list, fmt);
-		int ret = vsscanf (val, fmt, list);
-		va_end (list);
-		if (ret != count)
-			return false;
-		return true;
-	}
-	return false;
-}
-
-static bool set_value_internal (struct atrfs_entry *ent, char *attr, char *fmt, ...)
-{
-	char *buf = NULL;
-	va_list list;
-	va_start (list, fmt);
-	int ret = vasprintf (&buf, fmt, list);
-	va_end (list);
-	if (ret < 0)
-		return false;
-
-	entrydb_put (ent, attr, buf);
-	ret = 0;
-
-	free (buf);
-	if (ret == 0)
-		return true;
-	return false;
-}
-
 int get_ivalue (struct atrfs_entry *ent, char *attr, int def)
 {
 	int value;
-	if (get_value_internal (ent, attr, 1, "%d", &value))
+	if (entrydb_get_int (ent, attr, &value))
 		return value;
 	return def;
 }
@@ -71,54 +39,93 @@ int get_ivalue (struct atrfs_entry *ent, char *attr, int def)
 double get_dvalue (struct atrfs_entry *ent, char *attr, double def)
 {
 	double value;
-	if (get_value_internal (ent, attr, 1, "%lf", &value))
+	if (entrydb_get_double (ent, attr, &value))
 		return value;
 	return def;
 }
 
+/* The count and the watchtime are shown as st_nlink and st_mtime. */
+static bool is_stat_attr (char *attr)
+{
+	return strcmp (attr, "count") == 0 || strcmp (attr, "watchtime") == 0;
+}
+
 void set_ivalue (struct atrfs_entry *ent, char *attr, int value)
 {
 	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
-	set_value_internal(ent, attr, "%d", value);
+	entrydb_put_int (ent, attr, value);
+	if (is_stat_attr (attr))
+		inval_inode (ent);
 }
 
 void set_dvalue (struct atrfs_entry *ent, char *attr, double value)
 {
 	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
-	set_value_internal(ent, attr, "%lf", value);
+	entrydb_put_double (ent, attr, value);
+	if (FILE_ENTRY(ent)->rank && strcmp (attr, "watchtime") == 0)
+		rank_entry (ent);
+	if (is_stat_attr (attr))
+		inval_inode (ent);
 }
 
-char *uniquify_name (char *name, struct atrfs_entry *root)
+/*
+ * Return a name that no file in the tree has: NAME, or NAME with a
+ * number before the extension. The last number given for each name
+ * is remembered, so that many files of the same name don't try the
+ * numbers from 2 up every time.
+ */
+char *uniquify_name (char *name)
 {
-	char *uniq = strdup (name);
+	static GHashTable *last_number;
 
-	int globally_unique (struct atrfs_entry *ent)
-	{
-		if (strcmp (uniq, ent->name) == 0)
-			return 1;
-		return 0;
-	}
+	if (! leaf_name_in_use (name))
+		return strdup (name);
+	if (! last_number)
+		last_number = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
 
 	int len = strlen (name);
 	char *ext = strrchr (name, '.');
 	if (! ext)
 		ext = name + strlen (name);
 
-	int i;
-	for (i = 2;; i++)
+	int i = GPOINTER_TO_INT (g_hash_table_lookup (last_number, name));
+	if (i < 2)
+		i = 2;
+	for (;; i++)
 	{
-		if (map_leaf_entries (root, globally_unique) == 0)
+		char buf[len + 10];
+		sprintf (buf, "%.*s %d%s", (int)(ext - name), name, i, ext);
+		if (! leaf_name_in_use (buf))
 		{
-			return uniq;
-		} else {
-			char buf[len + 10];
-			sprintf (buf, "%.*s %d%s", (int)(ext - name), name, i, ext);
-			free (uniq);
-			uniq = strdup (buf);
+			g_hash_table_replace (last_number, strdup (name), GINT_TO_POINTER (i));
+			return strdup (buf);
 		}
 	}
 }
 
+void stat_to_stamp (const struct stat *st, struct file_stamp *stamp)
+{
+	memset (stamp, 0, sizeof (*stamp));
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->size = st->st_size;
+	stamp->mtime_ns = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+bool get_file_stamp (const char *filename, struct file_stamp *stamp)
+{
+	struct stat st;
+	if (stat (filename, &st) < 0)
+		return false;
+	stat_to_stamp (&st, stamp);
+	return true;
+}
+
+bool same_stamp (struct file_stamp *a, struct file_stamp *b)
+{
+	return memcmp (a, b, sizeof (*a)) == 0;
+}
+
 char *get_related_name (char *filename, char *old_ext, char *new_ext)
 {
 	char *srtname = NULL;
@@ -130,10 +137,12 @@ char *get_related_name (char *filename, char *old_ext, char *new_ext)
 
 void tmplog(char *fmt, ...)
 {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	static FILE *fp;
 	va_list list;
 	va_start(list, fmt);
 
+	pthread_mutex_lock(&lock);
 	if (!fp)
 		fp = fopen("/tmp/loki.txt", "w+");
 	if (fp)
@@ -142,61 +151,123 @@ void tmplog(char *fmt, ...)
 		fflush(fp);
 //		fclose(fp);
 	}
+	pthread_mutex_unlock(&lock);
 
 	va_end(list);
 }
 
-extern bool entrydb_exec (int (*callback)(void *data, int ncols, char **values, char **names)
-			  , char *cmdfmt, ...);
+/* File entries by watchtime, the most watched first. */
+static GSequence *ranking;
 
-extern GHashTable *sha1_to_entry_map;
+static gint compare_rank (gconstpointer a, gconstpointer b, gpointer unused)
+{
+	double wa = FILE_ENTRY(a)->ranked_watchtime;
+	double wb = FILE_ENTRY(b)->ranked_watchtime;
 
-void get_all_file_entries (struct atrfs_entry ***entries, size_t *count)
+	if (wa != wb)
+		return wa > wb ? -1 : 1;
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Put ENT in its place in the ranking, or move it there when its
+ * watchtime has changed. There should be one ranked entry per key.
+ */
+void rank_entry (struct atrfs_entry *ent)
 {
-	if (! entries || ! count)
-		abort ();
+	struct atrfs_file_entry *fent = FILE_ENTRY(ent);
+	double watchtime = get_watchtime (ent);
+
+	ASSERT_TYPE (ent, ATRFS_FILE_ENTRY);
+	if (! ranking)
+		ranking = g_sequence_new (NULL);
 
-	struct atrfs_entry **ptr;
-	size_t nitems = g_hash_table_size (sha1_to_entry_map);
+	if (fent->rank && fent->ranked_watchtime == watchtime)
+		return;
+	fent->ranked_watchtime = watchtime;
+	if (fent->rank)
+		g_sequence_sort_changed (fent->rank, compare_rank, NULL);
+	else
+		fent->rank = g_sequence_insert_sorted (ranking, ent, compare_rank, NULL);
+}
 
-	int inserter (void *unused, int ncols, char **values, char **names)
+void unrank_entry (struct atrfs_entry *ent)
+{
+	if (FILE_ENTRY(ent)->rank)
 	{
-		struct atrfs_entry *ent = g_hash_table_lookup (sha1_to_entry_map, values[0]);
-		if (ent)
-			*ptr++ = ent;
+		g_sequence_remove (FILE_ENTRY(ent)->rank);
+		FILE_ENTRY(ent)->rank = NULL;
+	}
+}
+
+/*
+ * Store at most K entries in ENTRIES, the most watched first, or
+ * the least watched first if REVERSE. Return the number stored.
+ */
+size_t get_ranked_entries (struct atrfs_entry **entries, size_t k, bool reverse)
+{
+	GSequenceIter *it;
+	size_t n = 0;
+
+	if (! ranking || k == 0)
 		return 0;
+
+	if (reverse)
+	{
+		it = g_sequence_get_end_iter (ranking);
+		while (n < k && ! g_sequence_iter_is_begin (it))
+		{
+			it = g_sequence_iter_prev (it);
+			entries[n++] = g_sequence_get (it);
+		}
+	} else {
+		it = g_sequence_get_begin_iter (ranking);
+		while (n < k && ! g_sequence_iter_is_end (it))
+		{
+			entries[n++] = g_sequence_get (it);
+			it = g_sequence_iter_next (it);
+		}
 	}
+	return n;
+}
 
+void get_all_file_entries (struct atrfs_entry ***entries, size_t *count)
+{
+	if (! entries || ! count)
+		abort ();
+
+	size_t nitems = ranking ? g_sequence_get_length (ranking) : 0;
 	struct atrfs_entry **ents = malloc ((nitems + 1) * sizeof (struct atrfs_entry *));
-	ptr = ents;
-	entrydb_exec (inserter, "SELECT sha1 FROM Files ORDER BY watchtime DESC");
-	*ptr = NULL;
+	if (! ents)
+		abort ();
+
+	nitems = get_ranked_entries (ents, nitems, false);
+	ents[nitems] = NULL;
 
 	*entries = ents;
 	*count = nitems;
 }
 
-char *secs_to_timestr (double secs)
+/* Format SECS as mm:ss in BUF, which has room for TIMESTR_SIZE chars. */
+char *secs_to_timestr (double secs, char *buf)
 {
-	static int count;
-	static char buf[2][10];	/* XXX */
 	int min = (int)secs / 60;
 	int sec = (int)secs % 60;
-	count = (count + 1) % 2;
-	sprintf (buf[count], "%02d:%02d", min, sec);
-	return buf[count];
+	snprintf (buf, TIMESTR_SIZE, "%02d:%02d", min, sec);
+	return buf;
 }
 
-char *pid_to_cmdline(pid_t pid)
+/* Read the command of PID into BUF; return NULL if it is gone. */
+char *pid_to_cmdline(pid_t pid, char *buf, size_t size)
 {
 	char *ret = NULL;
-	static char buf[128]; //XXX
-	sprintf(buf, "/proc/%d/cmdline", pid);
+	char path[32];
+	sprintf(path, "/proc/%d/cmdline", pid);
 
-	FILE *fp = fopen(buf, "r");
+	FILE *fp = fopen(path, "r");
 	if (fp)
 	{
-		ret = fgets(buf, sizeof(buf), fp);
+		ret = fgets(buf, size, fp);
 		fclose(fp);
 	}
 
@@ -10,14 +10,22 @@ double get_dvalue (struct atrfs_entry *ent, char *attr, double def);
 void set_ivalue (struct atrfs_entry *ent, char *attr, int value);
 void set_dvalue (struct atrfs_entry *ent, char *attr, double value);
 
-char *uniquify_name (char *name, struct atrfs_entry *root);
+char *uniquify_name (char *name);
 
 void tmplog(char *fmt, ...);
+void rank_entry (struct atrfs_entry *ent);
+void unrank_entry (struct atrfs_entry *ent);
+size_t get_ranked_entries (struct atrfs_entry **entries, size_t k, bool reverse);
 void get_all_file_entries (struct atrfs_entry ***entries, size_t *count);
-char *secs_to_timestr (double secs);
-char *pid_to_cmdline(pid_t pid);
+#define TIMESTR_SIZE 16
+char *secs_to_timestr (double secs, char *buf);
+char *pid_to_cmdline(pid_t pid, char *buf, size_t size);
 double doubletime(void);
 
+void stat_to_stamp (const struct stat *st, struct file_stamp *stamp);
+bool get_file_stamp (const char *filename, struct file_stamp *stamp);
+bool same_stamp (struct file_stamp *a, struct file_stamp *b);
+
 char *get_related_name (char *filename, char *old_ext, char *new_ext);
 
 #endif
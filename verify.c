@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#include "entry.h"
+#include "entrydb.h"
+#include "idcache.h"
+#include "inval.h"
+#include "media.h"
+#include "util.h"
+#include "verify.h"
+#include "workqueue.h"
+
+/* In main.c */
+extern GHashTable *sha1_to_entry_map;
+
+/* In statistics.c */
+extern void categorize_file_entry (struct atrfs_entry *ent);
+
+/*
+ * In fingerprint mode new files are keyed by get_fingerprint_r()
+ * so they show up without reading them completely. The real SHA1
+ * is computed here, in the background, and the Files table is
+ * reconciled with it. Files that inotify reports as rewritten are
+ * identified again here, too.
+ */
+bool fingerprint_mode;
+
+#define VERIFY_THREADS 1
+
+struct verify_work
+{
+	struct atrfs_entry *ent;
+	char *filename;
+	unsigned char fingerprint[KEY_SIZE];
+	unsigned char sha1[KEY_SIZE];
+	struct file_stamp stamp;
+	bool has_fingerprint;
+	bool hashed;		/* false if the file couldn't be read */
+};
+
+static struct workqueue *verify_queue;
+static GPtrArray *pending;
+static int next_pending;
+static int running;
+
+static void verify_file (void *data)
+{
+	struct verify_work *w = data;
+
+	/* Stamp first: if the file changes while hashing, it is hashed again later. */
+	get_file_stamp (w->filename, &w->stamp);
+	w->hashed = get_sha1_fast_r (w->filename, w->sha1) != NULL;
+}
+
+static void rekey_entry (struct atrfs_entry *ent, unsigned char *sha1)
+{
+	unsigned char *key = FILE_ENTRY(ent)->key;
+	struct atrfs_entry *other;
+
+	/* The map uses the key inside the entry, so drop it before changing it. */
+	if (g_hash_table_lookup (sha1_to_entry_map, key) == ent)
+		g_hash_table_remove (sha1_to_entry_map, key);
+
+	memcpy (key, sha1, KEY_SIZE);
+	/* The file was rewritten: its size and the watch count change. */
+	inval_inode (ent);
+	FILE_ENTRY(ent)->row = NULL;
+	FILE_ENTRY(ent)->changed = COLUMN_ALL;
+	FILE_ENTRY(ent)->probed = false;
+
+	/* A merge may have changed the watchtime, and the key has one entry. */
+	other = g_hash_table_lookup (sha1_to_entry_map, key);
+	if (other && other != ent)
+		unrank_entry (other);
+	g_hash_table_replace (sha1_to_entry_map, key, ent);
+	rank_entry (ent);
+}
+
+static void verified (void *data)
+{
+	struct verify_work *w = data;
+	struct atrfs_entry *ent = w->ent;
+	unsigned char *key = FILE_ENTRY(ent)->key;
+
+	running--;
+	/* The file was removed from the tree while it was hashed. */
+	if (ent->flags & ENTRY_DELETED)
+		goto out;
+
+	/* The entry keeps its key and stays provisional. */
+	if (! w->hashed)
+	{
+		tmplog ("Can't verify %s\n", w->filename);
+		goto out;
+	}
+
+	FILE_ENTRY(ent)->stamp = w->stamp;
+	FILE_ENTRY(ent)->provisional = false;
+
+	if (memcmp (key, w->sha1, KEY_SIZE))
+	{
+		if (w->has_fingerprint && memcmp (key, w->fingerprint, KEY_SIZE) == 0)
+		{
+			/* The provisional row gets its real key. */
+			entrydb_rekey (key, w->sha1);
+		} else {
+			/*
+			 * Either the file has new contents or its
+			 * fingerprint matched a row of another file.
+			 * In the latter case both rows keep the
+			 * fingerprint so that it is ambiguous from now
+			 * on and these files are always identified by
+			 * their full hash.
+			 */
+			if (w->has_fingerprint)
+				tmplog ("Fingerprint collision: %s\n", w->filename);
+			entrydb_ensure_exists (w->sha1);
+		}
+		if (w->has_fingerprint)
+			entrydb_set_fingerprint (w->sha1, w->fingerprint);
+		rekey_entry (ent, w->sha1);
+		media_prefetch (ent);
+
+		/* An open file is categorized again when it is released. */
+		if (!(ent->flags & ENTRY_BUSY))
+			categorize_file_entry (ent);
+	}
+
+out:
+	free (w->filename);
+	free (w);
+	verify_start ();
+}
+
+/*
+ * Compute the real SHA1 of ENT in the background. FINGERPRINT
+ * is the fingerprint ENT was identified by, or NULL.
+ */
+void verify_entry (struct atrfs_entry *ent, unsigned char *fingerprint)
+{
+	struct verify_work *w = malloc (sizeof (*w));
+	if (! w)
+		abort ();
+
+	memset (&w->stamp, 0, sizeof (w->stamp));
+	w->ent = ent;
+
+	/* Until verified, the key is not known to match any stamp. */
+	memset (&FILE_ENTRY(ent)->stamp, 0, sizeof (FILE_ENTRY(ent)->stamp));
+	if (fingerprint)
+		FILE_ENTRY(ent)->provisional = true;
+	w->filename = strdup (REAL_NAME(ent));
+	w->has_fingerprint = fingerprint != NULL;
+	if (fingerprint)
+		memcpy (w->fingerprint, fingerprint, KEY_SIZE);
+
+	if (! pending)
+		pending = g_ptr_array_new ();
+	g_ptr_array_add (pending, w);
+}
+
+/*
+ * Keep the verifying threads busy. The pending list is not limited
+ * but only a few items at a time are given to the work queue, so
+ * that the FUSE loop never blocks on it.
+ */
+void verify_start (void)
+{
+	if (! verify_queue)
+		verify_queue = workqueue_new (VERIFY_THREADS, 2 * VERIFY_THREADS);
+
+	if (! pending)
+		return;
+
+	while (running < 2 * VERIFY_THREADS && next_pending < pending->len)
+	{
+		running++;
+		workqueue_add (verify_queue, verify_file, verified,
+			       g_ptr_array_index (pending, next_pending++));
+	}
+
+	if (next_pending == pending->len)
+	{
+		g_ptr_array_free (pending, TRUE);
+		pending = NULL;
+		next_pending = 0;
+	}
+}
+
+int verify_fd (void)
+{
+	return workqueue_fd (verify_queue);
+}
+
+void handle_verify (void)
+{
+	if (verify_queue)
+		workqueue_complete (verify_queue);
+}
@@ -0,0 +1,14 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+#include <stdbool.h>
+#include "entry.h"
+
+/* In verify.c */
+extern bool fingerprint_mode;
+
+void verify_entry (struct atrfs_entry *ent, unsigned char *fingerprint);
+void verify_start (void);
+int verify_fd (void);
+void handle_verify (void);
+
+#endif /* VERIFY_H */
@@ -0,0 +1,395 @@
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "walk.h"
+
+/*
+ * Directory walker for the scan. Unlike ftw(), it reads several
+ * directories at once: the threads take directories from a shared
+ * stack, read them with getdents64 and push the subdirectories they
+ * find. d_type tells directories from files without a stat, and a
+ * file is stat'ed only if its extension is wanted. Symbolic links
+ * and file systems without d_type need a stat for every entry.
+ *
+ * The DIR callback is called before a directory is read, so that an
+ * inotify watch set there sees the files created during the walk.
+ * The callbacks are called from any of the threads.
+ */
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct dir_id
+{
+	uint64_t dev;
+	uint64_t ino;
+};
+
+struct walk
+{
+	struct walk_ops *ops;
+	void *data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	GPtrArray *dirs;	/* paths waiting to be read */
+	int busy;		/* threads reading a directory */
+	GHashTable *seen;	/* dir_id of every directory read */
+};
+
+static guint dir_id_hash (gconstpointer key)
+{
+	const struct dir_id *id = key;
+	return id->ino ^ (id->ino >> 32) ^ id->dev;
+}
+
+static gboolean dir_id_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, sizeof (struct dir_id)) == 0;
+}
+
+static bool wanted (struct walk *w, const char *name)
+{
+	const char *ext = strrchr (name, '.');
+	int i;
+
+	if (! ext)
+		return false;
+	for (i = 0; w->ops->exts[i]; i++)
+		if (strcmp (ext, w->ops->exts[i]) == 0)
+			return true;
+	return false;
+}
+
+static char *join_path (const char *dir, const char *name)
+{
+	size_t dlen = strlen (dir), nlen = strlen (name);
+	char *path = malloc (dlen + nlen + 2);
+
+	if (! path)
+		abort ();
+	memcpy (path, dir, dlen);
+	path[dlen] = '/';
+	memcpy (path + dlen + 1, name, nlen + 1);
+	return path;
+}
+
+/* Queue directory PATH for reading. Takes ownership of PATH. */
+static void push_dir (struct walk *w, char *path)
+{
+	pthread_mutex_lock (&w->lock);
+	g_ptr_array_add (w->dirs, path);
+	pthread_cond_signal (&w->cond);
+	pthread_mutex_unlock (&w->lock);
+}
+
+/* Has the directory open in FD been read already? Links can make loops. */
+static bool seen_dir (struct walk *w, int fd)
+{
+	struct dir_id *id;
+	struct stat st;
+	bool seen;
+
+	if (fstat (fd, &st) < 0)
+		return true;
+
+	id = malloc (sizeof (*id));
+	if (! id)
+		abort ();
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+
+	pthread_mutex_lock (&w->lock);
+	seen = g_hash_table_lookup (w->seen, id) != NULL;
+	if (! seen)
+		g_hash_table_add (w->seen, id);
+	pthread_mutex_unlock (&w->lock);
+
+	if (seen)
+		free (id);
+	return seen;
+}
+
+static void read_dir (struct walk *w, char *path)
+{
+	char buf[32768] __attribute__((aligned(8)));
+	struct stat st;
+	long n, off;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (seen_dir (w, fd))
+	{
+		close (fd);
+		return;
+	}
+
+	if (w->ops->dir)
+		w->ops->dir (path, w->data);
+
+	while ((n = syscall (SYS_getdents64, fd, buf, sizeof (buf))) > 0)
+	{
+		for (off = 0; off < n; off += ((struct linux_dirent64 *)(buf + off))->d_reclen)
+		{
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+			char *name = d->d_name;
+
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+				continue;
+
+			switch (d->d_type)
+			{
+			case DT_DIR:
+				push_dir (w, join_path (path, name));
+				break;
+
+			case DT_REG:
+				if (! wanted (w, name) || fstatat (fd, name, &st, 0) < 0)
+					break;
+				goto file;
+
+			case DT_LNK:
+			case DT_UNKNOWN:
+				/* Follow links like ftw() does. */
+				if (fstatat (fd, name, &st, 0) < 0)
+					break;
+				if (S_ISDIR (st.st_mode))
+				{
+					push_dir (w, join_path (path, name));
+					break;
+				}
+				if (! S_ISREG (st.st_mode) || ! wanted (w, name))
+					break;
+			file:
+				{
+					char *fpath = join_path (path, name);
+					w->ops->file (fpath, &st, w->data);
+					free (fpath);
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+	close (fd);
+}
+
+static void *walk_thread (void *arg)
+{
+	struct walk *w = arg;
+
+	pthread_mutex_lock (&w->lock);
+	for (;;)
+	{
+		while (w->dirs->len == 0 && w->busy > 0)
+			pthread_cond_wait (&w->cond, &w->lock);
+		if (w->dirs->len == 0)
+			break;
+
+		char *path = g_ptr_array_remove_index (w->dirs, w->dirs->len - 1);
+		w->busy++;
+		pthread_mutex_unlock (&w->lock);
+
+		read_dir (w, path);
+		free (path);
+
+		pthread_mutex_lock (&w->lock);
+		w->busy--;
+	}
+
+	/* Nothing to read and nobody reading: wake the others to quit. */
+	pthread_cond_broadcast (&w->cond);
+	pthread_mutex_unlock (&w->lock);
+	return NULL;
+}
+
+/*
+ * Call OPS->file for every wanted file under PATH and OPS->dir for
+ * every directory, using NTHREADS threads. PATH can be a file, too.
+ */
+void walk_tree (const char *path, struct walk_ops *ops, int nthreads, void *data)
+{
+	struct walk w;
+	struct stat st;
+	pthread_t threads[nthreads > 1 ? nthreads - 1 : 1];
+	int i, started = 0;
+
+	if (stat (path, &st) < 0)
+		return;
+	if (! S_ISDIR (st.st_mode))
+	{
+		const char *name = strrchr (path, '/');
+		w.ops = ops;
+		if (S_ISREG (st.st_mode) && wanted (&w, name ? name + 1 : path))
+			ops->file (path, &st, data);
+		return;
+	}
+
+	w.ops = ops;
+	w.data = data;
+	pthread_mutex_init (&w.lock, NULL);
+	pthread_cond_init (&w.cond, NULL);
+	w.dirs = g_ptr_array_new ();
+	w.busy = 0;
+	w.seen = g_hash_table_new_full (dir_id_hash, dir_id_equal, free, NULL);
+
+	g_ptr_array_add (w.dirs, strdup (path));
+
+	/* The calling thread is one of the walkers. */
+	for (i = 0; i < nthreads - 1; i++)
+		if (pthread_create (&threads[started], NULL, walk_thread, &w) == 0)
+			started++;
+	walk_thread (&w);
+	for (i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+
+	g_hash_table_destroy (w.seen);
+	g_ptr_array_free (w.dirs, TRUE);
+	pthread_cond_destroy (&w.cond);
+	pthread_mutex_destroy (&w.lock);
+}
+
+#ifdef WALK_BENCH
+#include <sys/time.h>
+#include <ftw.h>
+
+static const char *exts[] = { ".flv", ".webm", NULL };
+
+static double now (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* NFILES files in directories of 1000, every fifth of them a video. */
+static void make_tree (const char *top, int nfiles)
+{
+	char path[4096];
+	int i;
+
+	mkdir (top, 0755);
+	for (i = 0; i < nfiles; i++)
+	{
+		static const char *names[] = { ".flv", ".webm", ".jpg", ".txt", ".nfo" };
+		int fd;
+
+		if (i % 1000 == 0)
+		{
+			snprintf (path, sizeof (path), "%s/%d", top, i / 100000);
+			mkdir (path, 0755);
+			snprintf (path, sizeof (path), "%s/%d/%d", top, i / 100000, i / 1000);
+			mkdir (path, 0755);
+		}
+		snprintf (path, sizeof (path), "%s/%d/%d/file %d%s", top,
+			  i / 100000, i / 1000, i, names[i % 5]);
+		fd = open (path, O_WRONLY | O_CREAT, 0644);
+		if (fd >= 0)
+			close (fd);
+	}
+}
+
+static int nfound, ndirs;
+
+/* What for_each_file() did before: ftw() and the extension check. */
+static void ftw_walk (const char *top)
+{
+	int handler (const char *fpath, const struct stat *sb, int type)
+	{
+		if (type == FTW_F)
+		{
+			char *ext = strrchr (fpath, '.');
+			if (ext && (! strcmp (ext, ".flv") || ! strcmp (ext, ".webm")))
+				nfound++;
+		} else if (type == FTW_D) {
+			ndirs++;
+		}
+		return 0;
+	}
+	ftw (top, handler, 10);
+}
+
+static void count_file (const char *path, const struct stat *sb, void *data)
+{
+	__atomic_fetch_add (&nfound, 1, __ATOMIC_RELAXED);
+}
+
+static void count_dir (const char *path, void *data)
+{
+	__atomic_fetch_add (&ndirs, 1, __ATOMIC_RELAXED);
+}
+
+int main (int argc, char *argv[])
+{
+	const char *top = argc > 1 ? argv[1] : "walkbench.tree";
+	int nfiles = argc > 2 ? atoi (argv[2]) : 1000000;
+	int nthreads = argc > 3 ? atoi (argv[3]) : sysconf (_SC_NPROCESSORS_ONLN);
+	struct walk_ops ops = { exts, count_file, count_dir };
+	int ftw_found, ftw_dirs;
+	double start, t_ftw, t_one, t_all;
+	struct stat st;
+
+	if (stat (top, &st) < 0)
+	{
+		printf ("Creating %d files under %s\n", nfiles, top);
+		make_tree (top, nfiles);
+	}
+
+	/* Warm the cache so that every walk sees the same state. */
+	ftw_walk (top);
+
+	nfound = ndirs = 0;
+	start = now ();
+	ftw_walk (top);
+	t_ftw = now () - start;
+	ftw_found = nfound;
+	ftw_dirs = ndirs;
+
+	nfound = ndirs = 0;
+	start = now ();
+	walk_tree (top, &ops, 1, NULL);
+	t_one = now () - start;
+	if (nfound != ftw_found || ndirs != ftw_dirs)
+	{
+		printf ("1 thread found %d files, %d dirs; ftw %d, %d\n",
+			nfound, ndirs, ftw_found, ftw_dirs);
+		return 1;
+	}
+
+	nfound = ndirs = 0;
+	start = now ();
+	walk_tree (top, &ops, nthreads, NULL);
+	t_all = now () - start;
+	if (nfound != ftw_found || ndirs != ftw_dirs)
+	{
+		printf ("%d threads found %d files, %d dirs; ftw %d, %d\n",
+			nthreads, nfound, ndirs, ftw_found, ftw_dirs);
+		return 1;
+	}
+
+	printf ("%d files, %d dirs\n", ftw_found, ftw_dirs);
+	printf ("ftw          %8.3f s\n", t_ftw);
+	printf ("walk_tree x1 %8.3f s (%.1fx)\n", t_one, t_ftw / t_one);
+	printf ("walk_tree x%-2d%8.3f s (%.1fx)\n", nthreads, t_all, t_ftw / t_all);
+	return 0;
+}
+#endif /* WALK_BENCH */
@@ -0,0 +1,15 @@
+#ifndef WALK_H
+#define WALK_H
+#include <sys/stat.h>
+
+struct walk_ops
+{
+	/* Only files whose names end in one of these are reported. */
+	const char **exts;
+	void (*file)(const char *path, const struct stat *sb, void *data);
+	void (*dir)(const char *path, void *data);
+};
+
+void walk_tree (const char *path, struct walk_ops *ops, int nthreads, void *data);
+
+#endif /* WALK_H */
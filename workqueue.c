@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "workqueue.h"
+
+struct work
+{
+	void (*fn)(void *data);
+	void (*done)(void *data);
+	void *data;
+};
+
+struct done_work
+{
+	void (*done)(void *data);
+	void *data;
+	struct done_work *next;
+};
+
+/*
+ * A fixed pool of threads consuming a bounded ring of work items.
+ * Adding to a full queue blocks, so a fast producer (like ftw)
+ * can't run ahead of the workers and pile up memory.
+ *
+ * The DONE callback of a work item is not run by the worker: it is
+ * queued and a byte is written to a pipe, so that the thread owning
+ * the entry tree can poll workqueue_fd() and run it with
+ * workqueue_complete().
+ */
+struct workqueue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t idle;
+
+	struct work *ring;
+	int size;
+	int head;
+	int count;
+	int running;
+	bool quit;
+
+	struct done_work *done;
+	int pipe[2];
+
+	int nthreads;
+	pthread_t *threads;
+};
+
+int default_thread_count (void)
+{
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+static void *worker (void *arg)
+{
+	struct workqueue *wq = arg;
+
+	pthread_mutex_lock (&wq->lock);
+	for (;;)
+	{
+		while (wq->count == 0 && !wq->quit)
+			pthread_cond_wait (&wq->not_empty, &wq->lock);
+		if (wq->count == 0)
+			break;
+
+		struct work w = wq->ring[wq->head];
+		wq->head = (wq->head + 1) % wq->size;
+		wq->count--;
+		wq->running++;
+		pthread_cond_signal (&wq->not_full);
+		pthread_mutex_unlock (&wq->lock);
+
+		w.fn (w.data);
+
+		if (w.done)
+		{
+			struct done_work *d = malloc (sizeof (*d));
+			if (! d)
+				abort ();
+			d->done = w.done;
+			d->data = w.data;
+
+			pthread_mutex_lock (&wq->lock);
+			d->next = wq->done;
+			wq->done = d;
+			pthread_mutex_unlock (&wq->lock);
+			write (wq->pipe[1], "", 1);
+		}
+
+		pthread_mutex_lock (&wq->lock);
+		wq->running--;
+		if (wq->count == 0 && wq->running == 0)
+			pthread_cond_broadcast (&wq->idle);
+	}
+	pthread_mutex_unlock (&wq->lock);
+	return NULL;
+}
+
+struct workqueue *workqueue_new (int nthreads, int max_pending)
+{
+	struct workqueue *wq = calloc (1, sizeof (*wq));
+	int i;
+
+	if (! wq)
+		abort ();
+	if (nthreads < 1)
+		nthreads = 1;
+	if (max_pending < nthreads)
+		max_pending = nthreads;
+
+	pthread_mutex_init (&wq->lock, NULL);
+	pthread_cond_init (&wq->not_empty, NULL);
+	pthread_cond_init (&wq->not_full, NULL);
+	pthread_cond_init (&wq->idle, NULL);
+
+	wq->size = max_pending;
+	wq->ring = malloc (max_pending * sizeof (*wq->ring));
+	wq->nthreads = nthreads;
+	wq->threads = malloc (nthreads * sizeof (*wq->threads));
+	if (! wq->ring || ! wq->threads)
+		abort ();
+	if (pipe2 (wq->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		abort ();
+
+	for (i = 0; i < nthreads; i++)
+		pthread_create (&wq->threads[i], NULL, worker, wq);
+	return wq;
+}
+
+void workqueue_add (struct workqueue *wq, void (*fn)(void *data),
+	void (*done)(void *data), void *data)
+{
+	pthread_mutex_lock (&wq->lock);
+	while (wq->count == wq->size)
+		pthread_cond_wait (&wq->not_full, &wq->lock);
+
+	wq->ring[(wq->head + wq->count) % wq->size] = (struct work){ fn, done, data };
+	wq->count++;
+	pthread_cond_signal (&wq->not_empty);
+	pthread_mutex_unlock (&wq->lock);
+}
+
+/* Like workqueue_add(), but return false instead of waiting if the queue is full. */
+bool workqueue_try_add (struct workqueue *wq, void (*fn)(void *data),
+	void (*done)(void *data), void *data)
+{
+	pthread_mutex_lock (&wq->lock);
+	if (wq->count == wq->size)
+	{
+		pthread_mutex_unlock (&wq->lock);
+		return false;
+	}
+
+	wq->ring[(wq->head + wq->count) % wq->size] = (struct work){ fn, done, data };
+	wq->count++;
+	pthread_cond_signal (&wq->not_empty);
+	pthread_mutex_unlock (&wq->lock);
+	return true;
+}
+
+/* Wait until every queued work item has been run. */
+void workqueue_wait (struct workqueue *wq)
+{
+	pthread_mutex_lock (&wq->lock);
+	while (wq->count > 0 || wq->running > 0)
+		pthread_cond_wait (&wq->idle, &wq->lock);
+	pthread_mutex_unlock (&wq->lock);
+}
+
+int workqueue_fd (struct workqueue *wq)
+{
+	return wq->pipe[0];
+}
+
+/* Run the DONE callbacks of finished work items. */
+void workqueue_complete (struct workqueue *wq)
+{
+	struct done_work *d, *next;
+	char buf[64];
+
+	while (read (wq->pipe[0], buf, sizeof (buf)) > 0)
+		;
+
+	pthread_mutex_lock (&wq->lock);
+	d = wq->done;
+	wq->done = NULL;
+	pthread_mutex_unlock (&wq->lock);
+
+	for (; d; d = next)
+	{
+		next = d->next;
+		d->done (d->data);
+		free (d);
+	}
+}
+
+void workqueue_destroy (struct workqueue *wq)
+{
+	int i;
+
+	pthread_mutex_lock (&wq->lock);
+	wq->quit = true;
+	pthread_cond_broadcast (&wq->not_empty);
+	pthread_mutex_unlock (&wq->lock);
+
+	for (i = 0; i < wq->nthreads; i++)
+		pthread_join (wq->threads[i], NULL);
+	workqueue_complete (wq);
+
+	close (wq->pipe[0]);
+	close (wq->pipe[1]);
+
+	pthread_cond_destroy (&wq->idle);
+	pthread_cond_destroy (&wq->not_full);
+	pthread_cond_destroy (&wq->not_empty);
+	pthread_mutex_destroy (&wq->lock);
+	free (wq->threads);
+	free (wq->ring);
+	free (wq);
+}
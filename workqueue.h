@@ -0,0 +1,21 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+#include <stdbool.h>
+
+struct workqueue;
+
+struct workqueue *workqueue_new (int nthreads, int max_pending);
+void workqueue_destroy (struct workqueue *wq);
+
+void workqueue_add (struct workqueue *wq, void (*fn)(void *data),
+	void (*done)(void *data), void *data);
+bool workqueue_try_add (struct workqueue *wq, void (*fn)(void *data),
+	void (*done)(void *data), void *data);
+void workqueue_wait (struct workqueue *wq);
+
+int workqueue_fd (struct workqueue *wq);
+void workqueue_complete (struct workqueue *wq);
+
+int default_thread_count (void);
+
+#endif /* WORKQUEUE_H */